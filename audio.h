@@ -0,0 +1,254 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chip8-core.h"
+#include "spsc-ring.h"
+
+// Turns the sound state of a core into 16 bit mono samples.
+//
+// Following XO-CHIP, while the sound timer is running the 128 bit audio
+// pattern is played on a loop, one bit per sample, at 4000 * 2^((pitch - 64) /
+// 48) samples per second. That rate rarely matches the output's sample rate,
+// so each output sample is the average of the pattern over the time it covers
+// rather than the nearest bit, which keeps high pitches from aliasing.
+class AudioSynth {
+public:
+  static constexpr int kSampleRate = 44100;
+
+  // Appends `seconds` worth of samples for the current state of the core to
+  // `samples` (after clearing it). Fractions of a sample are carried over to
+  // the next call so that no time is lost.
+  void Render(const Chip8State& state, double seconds,
+              std::vector<int16_t>& samples) {
+    samples_owed_ += seconds * kSampleRate;
+    int count = samples_owed_;
+    samples_owed_ -= count;
+    samples.assign(count, 0);
+    if (state.sound_timer == 0) {
+      return;
+    }
+
+    constexpr int16_t kAmplitude = 8000;
+    constexpr int kPatternBits = 128;
+    auto pattern_rate = 4000 * std::pow(2.0, (state.audio_pitch - 64) / 48.0);
+    auto step = pattern_rate / kSampleRate;
+    for (auto& sample : samples) {
+      auto level = PatternCoverage(state, phase_, step) / step;
+      sample = (2 * level - 1) * kAmplitude;
+      phase_ = std::fmod(phase_ + step, kPatternBits);
+    }
+  }
+
+private:
+  // How much of [start, start + length) (measured in pattern bits) is covered
+  // by set bits of the pattern.
+  static double PatternCoverage(const Chip8State& state, double start,
+                                double length) {
+    double covered = 0;
+    auto end = start + length;
+    for (auto position = start; position < end;) {
+      auto bit_end = std::min(std::floor(position) + 1, end);
+      int bit = int(position) % 128;
+      if ((state.audio_pattern[bit / 8] >> (7 - bit % 8)) & 1) {
+        covered += bit_end - position;
+      }
+      position = bit_end;
+    }
+    return covered;
+  }
+
+  double samples_owed_ = 0;
+  double phase_ = 0;
+};
+
+// Plays samples through the default SDL audio device. Samples are handed to
+// SDL's audio thread through a lock-free ring so the emulator never waits on
+// it; if the ring runs dry the device plays silence.
+class AudioOutput {
+public:
+  AudioOutput() : ring_(AudioSynth::kSampleRate / 2) {
+    SDL_InitSubSystem(SDL_INIT_AUDIO);
+    SDL_AudioSpec desired{};
+    desired.freq = AudioSynth::kSampleRate;
+    desired.format = AUDIO_S16SYS;
+    desired.channels = 1;
+    desired.samples = 512;
+    desired.callback = &AudioOutput::FillBuffer;
+    desired.userdata = this;
+    device_ = SDL_OpenAudioDevice(/* device = */ nullptr, /* iscapture = */ 0,
+                                  &desired, /* obtained = */ nullptr,
+                                  /* allowed_changes = */ 0);
+    if (device_ != 0) {
+      SDL_PauseAudioDevice(device_, /* pause_on = */ 0);
+    }
+  }
+
+  ~AudioOutput() {
+    if (device_ != 0) {
+      SDL_CloseAudioDevice(device_);
+    }
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+  }
+
+  AudioOutput(const AudioOutput&) = delete;
+  AudioOutput& operator=(const AudioOutput&) = delete;
+
+  void Push(const std::vector<int16_t>& samples) {
+    // The emulator's frame clock and the audio device's clock drift apart, so
+    // drop samples rather than letting latency build up.
+    constexpr size_t kMaxQueuedSamples = AudioSynth::kSampleRate / 10;
+    if (ring_.size() < kMaxQueuedSamples) {
+      ring_.Push(samples.data(), samples.size());
+    }
+  }
+
+private:
+  // Called by SDL on its audio thread.
+  static void FillBuffer(void* userdata, Uint8* stream, int length) {
+    auto* self = static_cast<AudioOutput*>(userdata);
+    auto* samples = reinterpret_cast<int16_t*>(stream);
+    size_t count = length / sizeof(int16_t);
+    auto popped = self->ring_.Pop(samples, count);
+    std::fill(samples + popped, samples + count, 0);
+  }
+
+  SpscRing<int16_t> ring_;
+  SDL_AudioDeviceID device_ = 0;
+};
+
+// Records samples to a 16 bit mono WAV file. The file is written by a
+// background thread so that a slow disk can't stall the emulator, which only
+// copies samples into a lock-free ring.
+//
+// An emulator running in real time drops samples if the ring fills up rather
+// than waiting for the disk. One running as fast as it can (i.e. headless)
+// produces samples far faster than they play, so with `wait_for_space` it
+// waits for the writer instead and nothing is lost.
+class WavRecorder {
+public:
+  WavRecorder(const std::string& path, bool wait_for_space = false)
+      : ring_(AudioSynth::kSampleRate * 4),
+        file_(path, std::ios::binary),
+        wait_for_space_(wait_for_space) {
+    if (!file_) {
+      return;
+    }
+    // Sizes are filled in once recording is done.
+    WriteHeader(/* data_bytes = */ 0);
+    writer_ = std::thread([this]() { WriteSamples(); });
+  }
+
+  ~WavRecorder() {
+    if (!writer_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    file_.seekp(0);
+    WriteHeader(data_bytes_);
+  }
+
+  WavRecorder(const WavRecorder&) = delete;
+  WavRecorder& operator=(const WavRecorder&) = delete;
+
+  // False if the file couldn't be opened.
+  bool ok() const { return writer_.joinable(); }
+
+  void Push(const std::vector<int16_t>& samples) {
+    auto pushed = ring_.Push(samples.data(), samples.size());
+    while (wait_for_space_ && pushed < samples.size()) {
+      // Have the writer drain the ring now rather than when it next wakes.
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        drain_ = true;
+        wake_.notify_one();
+        drained_.wait(lock, [this]() { return !drain_; });
+      }
+      pushed += ring_.Push(samples.data() + pushed, samples.size() - pushed);
+    }
+    dropped_samples_ += samples.size() - pushed;
+  }
+
+  // Samples lost because the writer couldn't keep up.
+  int64_t dropped_samples() const { return dropped_samples_; }
+
+private:
+  void WriteSamples() {
+    while (true) {
+      // Read `stop_` before draining so nothing pushed before it was set is
+      // left behind.
+      bool stop = stop_;
+      int16_t samples[4096];
+      while (auto count = ring_.Pop(samples, std::size(samples))) {
+        for (size_t i = 0; i < count; ++i) {
+          Write(uint16_t(samples[i]), 2);
+        }
+        data_bytes_ += count * 2;
+      }
+      if (stop) {
+        return;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      drain_ = false;
+      drained_.notify_one();
+      wake_.wait_for(lock, std::chrono::milliseconds(20),
+                     [this]() { return drain_ || stop_; });
+    }
+  }
+
+  // Writes the low `size` bytes of `value` in little endian order.
+  void Write(uint32_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+      file_.put((value >> (8 * i)) & 0xFF);
+    }
+  }
+
+  void WriteHeader(uint32_t data_bytes) {
+    constexpr int kBytesPerSample = 2;
+    file_.write("RIFF", 4);
+    Write(36 + data_bytes, 4);
+    file_.write("WAVEfmt ", 8);
+    Write(16, 4);                                         // fmt chunk size
+    Write(1, 2);                                          // PCM
+    Write(1, 2);                                          // mono
+    Write(AudioSynth::kSampleRate, 4);                    // sample rate
+    Write(AudioSynth::kSampleRate * kBytesPerSample, 4);  // byte rate
+    Write(kBytesPerSample, 2);                            // block align
+    Write(8 * kBytesPerSample, 2);                        // bits per sample
+    file_.write("data", 4);
+    Write(data_bytes, 4);
+  }
+
+  SpscRing<int16_t> ring_;
+  std::ofstream file_;
+  std::thread writer_;
+  std::atomic<bool> stop_ = false;
+  std::atomic<int64_t> dropped_samples_ = 0;
+  bool wait_for_space_;
+  // Wakes the writer early, and tells `Push` when it has drained the ring.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable drained_;
+  bool drain_ = false;
+  uint32_t data_bytes_ = 0;
+};
+
+#endif /* AUDIO_H */
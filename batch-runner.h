@@ -0,0 +1,214 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block-engine.h"
+#include "chip8-core.h"
+#include "watchdog.h"
+
+// Runs many headless emulator instances of the same ROM across a pool of
+// worker threads, e.g. for reinforcement learning or search.
+//
+// Each worker is pinned to its own CPU, with workers spread evenly across the
+// machine's NUMA nodes, and owns a fixed range of instances for the whole run.
+// Workers create their own cores after being pinned, so with Linux's
+// first-touch allocation policy all of a worker's emulator state (memory,
+// framebuffers, ...) lives on its own node and is never touched by another
+// socket. Each worker also has its own `BlockEngine`, so the code it decodes
+// is shared by all of its instances.
+class BatchRunner {
+public:
+  // Picks the keys held down by `instance` during `frame`. Called from the
+  // worker thread which owns the instance.
+  using InputFn =
+      std::function<uint16_t(int instance, int frame, const Chip8Core& core)>;
+  // Called from the owning worker thread once `instance` has stopped, with the
+  // reason why.
+  using DoneFn = std::function<void(int instance, const Chip8Core& core,
+                                    WatchdogResult result)>;
+
+  struct Stats {
+    int64_t frames = 0;
+    int64_t instructions = 0;
+    std::chrono::nanoseconds elapsed{0};
+    // The number of instances which were stopped early.
+    int64_t hung = 0;
+    int64_t faulted = 0;
+    int64_t timed_out = 0;
+
+    void Add(const Stats& other) {
+      frames += other.frames;
+      instructions += other.instructions;
+      hung += other.hung;
+      faulted += other.faulted;
+      timed_out += other.timed_out;
+    }
+  };
+
+  // Instance `i` of a run draws its random numbers from seed `seed + i`, so
+  // instances are independent of each other and a run can be reproduced.
+  BatchRunner(int num_workers = std::thread::hardware_concurrency(),
+              bool pin_threads = true, uint64_t seed = 0,
+              const BlockEngineOptions& engine = {})
+      : num_workers_(std::max(1, num_workers)), pin_threads_(pin_threads),
+        seed_(seed), engine_options_(engine) {}
+
+  // Runs `num_instances` instances of `rom`, each until it reaches one of
+  // `limits` or hangs. With no `input` every instance runs with no keys held.
+  // `limits` should limit the frames, instructions or time; there's no
+  // guarantee that a ROM ever stops by itself.
+  Stats Run(const std::vector<unsigned char>& rom, int num_instances,
+            const WatchdogLimits& limits, const InputFn& input = nullptr,
+            const DoneFn& done = nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    auto cpus = WorkerCpus();
+    std::vector<Stats> worker_stats(num_workers_);
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < num_workers_; ++worker) {
+      workers.emplace_back([&, worker]() {
+        if (pin_threads_) {
+          PinToCpu(cpus[worker]);
+        }
+
+        int first_instance = int64_t(num_instances) * worker / num_workers_;
+        int last_instance =
+            int64_t(num_instances) * (worker + 1) / num_workers_;
+        std::vector<Chip8Core> cores(last_instance - first_instance);
+        for (size_t i = 0; i < cores.size(); ++i) {
+          cores[i].Seed(seed_ + first_instance + i);
+          cores[i].LoadRom(rom);
+        }
+
+        // Run each instance to completion before moving on to the next so its
+        // state stays in this CPU's caches. An instance that hangs or faults
+        // is stopped straight away to make room for the next one.
+        auto& stats = worker_stats[worker];
+        BlockEngine engine(engine_options_);
+        Watchdog watchdog(limits);
+        for (size_t i = 0; i < cores.size(); ++i) {
+          watchdog.Start(cores[i]);
+          auto result = WatchdogResult::kRunning;
+          for (int frame = 0; result == WatchdogResult::kRunning; ++frame) {
+            uint16_t keys = 0;
+            if (input) {
+              keys = input(first_instance + i, frame, cores[i]);
+              cores[i].SetKeys(keys);
+            }
+            engine.RunFrame(cores[i]);
+            result = watchdog.Check(cores[i], keys);
+          }
+          stats.frames += watchdog.frames();
+          stats.hung += result == WatchdogResult::kHung;
+          stats.faulted += result == WatchdogResult::kFaulted;
+          stats.timed_out += result == WatchdogResult::kWallTimeLimit;
+          if (done) {
+            done(first_instance + i, cores[i], result);
+          }
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    Stats stats;
+    for (auto& worker : worker_stats) {
+      stats.Add(worker);
+    }
+    stats.instructions = stats.frames * Chip8Core::kInstructionsPerFrame;
+    stats.elapsed = std::chrono::steady_clock::now() - start;
+    return stats;
+  }
+
+private:
+  // The CPU for each worker: round robin across NUMA nodes, then across the
+  // CPUs within each node.
+  std::vector<int> WorkerCpus() {
+    auto nodes = NumaNodeCpus();
+    std::vector<int> cpus;
+    for (int i = 0; int(cpus.size()) < num_workers_; ++i) {
+      auto& node = nodes[i % nodes.size()];
+      cpus.push_back(node[(i / nodes.size()) % node.size()]);
+    }
+    return cpus;
+  }
+
+  // The CPUs that this process may run on, grouped by NUMA node. Without NUMA
+  // information all of the CPUs are treated as one node.
+  static std::vector<std::vector<int>> NumaNodeCpus() {
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(/* pid = */ 0, sizeof(allowed), &allowed);
+    std::vector<int> all_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        all_cpus.push_back(cpu);
+      }
+    }
+
+    for (int node = 0;; ++node) {
+      std::ifstream cpulist("/sys/devices/system/node/node" +
+                            std::to_string(node) + "/cpulist");
+      if (!cpulist) {
+        break;
+      }
+      // A comma separated list of CPUs and ranges of CPUs, e.g. "0-7,16-23".
+      std::vector<int> node_cpus;
+      std::string range;
+      while (std::getline(cpulist, range, ',')) {
+        auto dash = range.find('-');
+        int first = std::stoi(range);
+        int last = dash == std::string::npos
+                       ? first
+                       : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+          if (CPU_ISSET(cpu, &allowed)) {
+            node_cpus.push_back(cpu);
+          }
+        }
+      }
+      if (!node_cpus.empty()) {
+        nodes.push_back(std::move(node_cpus));
+      }
+    }
+    if (nodes.empty() && !all_cpus.empty()) {
+      nodes.push_back(std::move(all_cpus));
+    }
+#endif
+    if (nodes.empty()) {
+      nodes.push_back({0});
+    }
+    return nodes;
+  }
+
+  static void PinToCpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+  }
+
+  int num_workers_;
+  bool pin_threads_;
+  uint64_t seed_;
+  BlockEngineOptions engine_options_;
+};
+
+#endif /* BATCH_RUNNER_H */
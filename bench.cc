@@ -0,0 +1,124 @@
+// Micro benchmarks for the emulator core. Build with `make bench` and run
+// `./bench [rom file]`; without a ROM a small built in program which exercises
+// the common instructions is used.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "block-engine.h"
+#include "chip8-core.h"
+
+namespace {
+
+// Counts heap allocations so that the memory used per instance includes what
+// the core allocates as well as its own size.
+std::atomic<int64_t> allocated_bytes = 0;
+
+// Draws digits across the screen forever using calls, arithmetic, BCD, the
+// font, random numbers and the delay timer.
+const std::vector<unsigned char> kBuiltInRom = {
+    0x00, 0xE0, 0x6A, 0x00, 0x6B, 0x00, 0xC1, 0x0F, 0xF1, 0x29, 0xDA,
+    0xB5, 0x7A, 0x05, 0x3A, 0x3C, 0x12, 0x18, 0x6A, 0x00, 0x7B, 0x06,
+    0x12, 0x18, 0x22, 0x30, 0xE1, 0x9E, 0x12, 0x20, 0x00, 0xE0, 0x4B,
+    0x1E, 0x6B, 0x00, 0x62, 0x03, 0xF2, 0x15, 0xF3, 0x07, 0x33, 0x00,
+    0x12, 0x28, 0x12, 0x06, 0xA3, 0x00, 0xF1, 0x33, 0xF2, 0x65, 0x80,
+    0x14, 0x81, 0x25, 0x82, 0x06, 0x00, 0xEE,
+};
+
+template <typename Fn> double SecondsFor(Fn&& fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Bytes of memory per core, measured by creating many of them.
+void BenchMemoryPerInstance(const std::vector<unsigned char>& rom) {
+  constexpr int kInstances = 10000;
+  auto before = allocated_bytes.load();
+  std::vector<Chip8Core> cores(kInstances);
+  for (auto& core : cores) {
+    core.LoadRom(rom);
+    // Run for a bit so that anything allocated lazily would be counted.
+    for (int frame = 0; frame < 60; ++frame) {
+      core.RunFrame();
+    }
+  }
+  auto bytes = double(allocated_bytes.load() - before) / kInstances;
+  std::cout << "memory per instance: " << bytes << " bytes (sizeof "
+            << sizeof(Chip8Core) << ")" << std::endl;
+}
+
+void BenchInterpreter(const std::vector<unsigned char>& rom) {
+  constexpr int kFrames = 2000000;
+  Chip8Core core;
+  core.LoadRom(rom);
+  auto seconds = SecondsFor([&]() {
+    for (int frame = 0; frame < kFrames; ++frame) {
+      core.RunFrame();
+    }
+  });
+  std::cout << "interpreter: "
+            << kFrames * Chip8Core::kInstructionsPerFrame / seconds / 1e6
+            << "M instructions/s" << std::endl;
+}
+
+void BenchBlockEngine(const std::vector<unsigned char>& rom) {
+  constexpr int kFrames = 2000000;
+  Chip8Core core;
+  core.LoadRom(rom);
+  BlockEngine engine;
+  auto seconds = SecondsFor([&]() {
+    for (int frame = 0; frame < kFrames; ++frame) {
+      engine.RunFrame(core);
+    }
+  });
+  std::cout << "block engine: "
+            << kFrames * Chip8Core::kInstructionsPerFrame / seconds / 1e6
+            << "M instructions/s" << std::endl;
+}
+
+void BenchSnapshots(const std::vector<unsigned char>& rom) {
+  constexpr int kSnapshots = 1000000;
+  Chip8Core core;
+  core.LoadRom(rom);
+  Chip8State snapshot;
+  auto seconds = SecondsFor([&]() {
+    for (int i = 0; i < kSnapshots; ++i) {
+      core.SaveState(snapshot);
+      core.LoadState(snapshot);
+    }
+  });
+  std::cout << "snapshot save + load: " << seconds / kSnapshots * 1e9 << "ns"
+            << std::endl;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+  allocated_bytes += size;
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+int main(int argc, char** argv) {
+  auto rom = kBuiltInRom;
+  if (argc > 1 && !Chip8Core::ReadRom(argv[1], rom)) {
+    std::cout << "Failed to read " << argv[1] << std::endl;
+    return 1;
+  }
+  BenchMemoryPerInstance(rom);
+  BenchInterpreter(rom);
+  BenchBlockEngine(rom);
+  BenchSnapshots(rom);
+}
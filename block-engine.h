@@ -0,0 +1,1385 @@
+#ifndef BLOCK_ENGINE_H
+#define BLOCK_ENGINE_H
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chip8-core.h"
+
+// When code is promoted from one tier of `BlockEngine` to the next. A
+// threshold of 0 means never.
+struct BlockEngineOptions {
+  // Times the interpreter must reach an address before the code from there to
+  // the next branch is decoded into a block.
+  int decode_threshold = 16;
+  // Times a decoded block must run before it is recompiled with fused
+  // instructions.
+  int fuse_threshold = 256;
+};
+
+// Runs a `Chip8Core` faster by caching decoded code, while behaving exactly
+// like `Chip8Core::RunFrame`.
+//
+// Code is run in one of three tiers:
+//   - kInterpreted: one instruction at a time by `Chip8Core::Step`. Every
+//     address the interpreter reaches has a hit counter.
+//   - kDecoded: once an address is hot, the code from there is decoded into a
+//     block of micro-ops which run without fetching or decoding. Chip8
+//     programs branch every few instructions, so blocks are traces rather
+//     than basic blocks: a block carries on through skips (3XNN, EX9E, ...),
+//     including skips over jumps, and follows unconditional jumps. Jumps back
+//     into the block loop within it, and it only ends at a call, a return or
+//     an instruction left to the interpreter.
+//   - kFused: once a block is hot it is recompiled, fusing common pairs of
+//     instructions (e.g. ANNN followed by DXYN) into single micro-ops.
+//
+// A block always stops at the frame's instruction budget, part way through if
+// it has to, so timers tick at exactly the same point as in the interpreter.
+// Blocks are dropped when the program writes to their code (FX33 and FX55)
+// and are checked against memory whenever the core's memory is replaced (by
+// loading a ROM or a snapshot) or the engine is used with a different core.
+//
+// One engine can run any number of cores in turn, e.g. all the instances of
+// a ROM owned by a `BatchRunner` worker, which then share the decoded code.
+class BlockEngine {
+public:
+  enum Tier { kInterpreted, kDecoded, kFused, kNumTiers };
+
+  struct Stats {
+    std::array<int64_t, kNumTiers> instructions{};
+    std::array<int64_t, kNumTiers> blocks_compiled{};
+    int64_t blocks_invalidated = 0;
+    // See `FoldConstants` and `EliminateDeadWrites`.
+    int64_t constants_folded = 0;
+    int64_t dead_writes = 0;
+  };
+
+  explicit BlockEngine(const BlockEngineOptions& options = {})
+      : options_(options) {
+    block_at_.fill(-1);
+  }
+
+  // The same as `core.RunFrame()`.
+  void RunFrame(Chip8Core& core) {
+    Run(core, Chip8Core::kInstructionsPerFrame);
+    core.TickTimers();
+  }
+
+  // The same as calling `core.Step()` `budget` times, e.g. to run part of a
+  // frame when comparing the engine with the interpreter.
+  void Run(Chip8Core& core, int budget) {
+    Attach(core);
+    // The core may have been stepped on its own since the engine last ran it
+    // (e.g. by the debugger), writing over code that's in a block.
+    if (core.written_end_ > 0) {
+      CheckWrites(core);
+    }
+    auto& state = core.state_;
+    while (budget > 0) {
+      auto pc = state.program_counter;
+      if (state.fault != Chip8Fault::kNone || pc >= kMaxAddress) {
+        break;
+      }
+      if (block_at_[pc] >= 0) {
+        // A block which starts with a fused op can't run when there's only
+        // room for one instruction.
+        int executed = RunBlock(core, blocks_[block_at_[pc]], budget);
+        // Like the interpreter's, the program counter wraps around when a
+        // block leaves past the end of memory.
+        state.program_counter &= Chip8Core::kAddressMask;
+        if (executed > 0) {
+          budget -= executed;
+          continue;
+        }
+      } else if (options_.decode_threshold > 0 &&
+                 ++hits_[pc] >= uint32_t(options_.decode_threshold)) {
+        hits_[pc] = 0;
+        if (Compile(state.memory, pc, kDecoded)) {
+          continue;
+        }
+      }
+      core.Step();
+      --budget;
+      ++stats_.instructions[kInterpreted];
+      // Code the interpreter wrote to has to be dropped before a block can
+      // run it again.
+      if (core.written_end_ > 0) {
+        CheckWrites(core);
+      }
+    }
+    // Whatever is left of the frame is run by the interpreter, which also
+    // takes care of doing nothing once the machine has faulted.
+    for (; budget > 0; --budget) {
+      core.Step();
+      ++stats_.instructions[kInterpreted];
+    }
+    CheckWrites(core);
+  }
+
+  const Stats& stats() const { return stats_; }
+
+  // Prints the instructions run by each tier and the hottest blocks, for
+  // tuning the thresholds.
+  void DumpStats(std::ostream& out, int max_blocks = 16) const {
+    int64_t total = 0;
+    for (auto instructions : stats_.instructions) {
+      total += instructions;
+    }
+    out << "Block engine: " << total << " instructions\n";
+    for (int tier = 0; tier < kNumTiers; ++tier) {
+      out << "  " << std::setw(12) << std::left << TierName(Tier(tier))
+          << std::right << std::setw(14) << stats_.instructions[tier]
+          << " instructions";
+      if (total > 0) {
+        out << " (" << std::fixed << std::setprecision(1)
+            << 100.0 * stats_.instructions[tier] / total << "%)";
+      }
+      if (tier != kInterpreted) {
+        out << ", " << stats_.blocks_compiled[tier] << " blocks compiled";
+      }
+      out << "\n";
+    }
+    out << "  " << stats_.blocks_invalidated << " blocks invalidated, "
+        << stats_.constants_folded << " constants folded, "
+        << stats_.dead_writes << " dead writes removed\n";
+
+    std::vector<const Block*> hottest;
+    for (auto& block : blocks_) {
+      if (block.live) {
+        hottest.push_back(&block);
+      }
+    }
+    std::sort(hottest.begin(), hottest.end(), [](auto* a, auto* b) {
+      return a->instructions > b->instructions;
+    });
+    hottest.resize(std::min<size_t>(hottest.size(), max_blocks));
+    out << "  start  tier        length  ops   entries  instructions\n";
+    for (auto* block : hottest) {
+      out << "  0x" << std::hex << std::setfill('0') << std::setw(3)
+          << block->start << std::dec << std::setfill(' ') << "  "
+          << std::setw(10) << std::left << TierName(block->tier) << std::right
+          << std::setw(8) << block->source.size() << std::setw(5)
+          << block->ops.size() << std::setw(10) << block->entries
+          << std::setw(14) << block->instructions << "\n";
+    }
+    out << std::flush;
+  }
+
+  // Writes which blocks have been compiled, at which tier, and which way the
+  // skips in the program usually go, so that a later run of the same ROM can
+  // start with them with `LoadProfile`.
+  void SaveProfile(std::ostream& out) const {
+    out << kProfileHeader << "\n" << std::hex;
+    for (int address = 0; address < kMaxAddress; ++address) {
+      if (skip_bias_[address] != 0) {
+        out << "bias " << address << " " << std::dec << skip_bias_[address]
+            << std::hex << "\n";
+      }
+    }
+    for (auto& block : blocks_) {
+      if (block.live) {
+        out << "block " << block.start << " " << TierName(block.tier)
+            << "\n";
+      }
+    }
+    out << std::dec << std::flush;
+  }
+
+  // Compiles the blocks from a profile written by `SaveProfile` against
+  // `core`'s memory. Blocks are compiled from whatever code is in memory now,
+  // so a profile from a different version of the ROM is harmless, just less
+  // useful. Returns false if `in` isn't a profile.
+  bool LoadProfile(std::istream& in, Chip8Core& core) {
+    std::string line;
+    if (!std::getline(in, line) || line != kProfileHeader) {
+      return false;
+    }
+    Attach(core);
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string kind;
+      int address = -1;
+      fields >> kind >> std::hex >> address >> std::dec;
+      if (!fields || address < 0 || address >= kMaxAddress) {
+        continue;
+      }
+      if (kind == "bias") {
+        int bias = 0;
+        if (fields >> bias) {
+          skip_bias_[address] = std::clamp(bias, -kMaxSkipBias, kMaxSkipBias);
+        }
+      } else if (kind == "block" && options_.decode_threshold > 0) {
+        std::string tier;
+        fields >> tier;
+        if (tier == TierName(kFused) && options_.fuse_threshold > 0) {
+          Compile(core.state_.memory, address, kFused);
+        } else if (tier == TierName(kFused) || tier == TierName(kDecoded)) {
+          Compile(core.state_.memory, address, kDecoded);
+        }
+      }
+    }
+    return true;
+  }
+
+  static const char* TierName(Tier tier) {
+    switch (tier) {
+    case kInterpreted:
+      return "interpreted";
+    case kDecoded:
+      return "decoded";
+    case kFused:
+      return "fused";
+    case kNumTiers:
+      break;
+    }
+    return "";
+  }
+
+private:
+  // Instructions decoded into a form that can be run directly. The first
+  // group are one Chip8 instruction each; the fused ops are two, except that
+  // constant folding can turn any op into a kSet or similar.
+  enum class Op : unsigned char {
+    // An instruction with nothing left to do; see `EliminateDeadWrites`.
+    kNop,
+    kClear,
+    kReturn,
+    kJump,
+    // A 1NNN whose target is the next op in the block.
+    kFollowJump,
+    // A 1NNN back to an earlier op in the block: `n` is the op's index.
+    kLoop,
+    kCall,
+    kSkipEqual,
+    kSkipNotEqual,
+    kSkipEqualRegister,
+    kSkipNotEqualRegister,
+    kSet,
+    kAdd,
+    kMove,
+    kOr,
+    kAnd,
+    kXor,
+    kAddRegister,
+    kSubtract,
+    kShiftRight,
+    kSubtractReverse,
+    kShiftLeft,
+    kSetIndex,
+    kJumpOffset,
+    kRandom,
+    kDraw,
+    // A DXYN whose coordinates are known: `x` and `y` are their values.
+    kDrawAt,
+    kSkipKey,
+    kSkipNotKey,
+    kGetDelay,
+    kSetDelay,
+    kSetSound,
+    kLoadAudioPattern,
+    kSetPitch,
+    kAddIndex,
+    kFontCharacter,
+    kStoreDecimal,
+    kStoreRegisters,
+    kLoadRegisters,
+    // The fused ops; see `Fuse`.
+    // ANNN, DXYN: `constant` is NNN.
+    kSetIndexDraw,
+    // The same with known coordinates, as in kDrawAt.
+    kSetIndexDrawAt,
+    // 6XNN, 6YMM: `constant` is NN and `n` is MM.
+    kSetPair,
+    // 7XNN, 3XMM / 4XMM: `constant` is NN and `n` is MM.
+    kAddSkipEqual,
+    kAddSkipNotEqual,
+    // Loops which spin until something changes that can only change between
+    // frames, so they run to the end of the frame.
+    // FX07, 3XNN / 4XNN, 1NNN back to the FX07: `n` is 1 for 3XNN.
+    kWaitDelay,
+    // EX9E / EXA1, 1NNN back to the EX9E: `n` is 1 for EX9E.
+    kWaitKey,
+  };
+
+  struct MicroOp {
+    Op op;
+    unsigned char x = 0;
+    unsigned char y = 0;
+    unsigned char n = 0;
+    // The 8 or 12 bit constant of the instruction.
+    uint16_t constant = 0;
+    // Where the (first) instruction is in memory.
+    uint16_t pc = 0;
+    // For skips: whether taking the skip leaves the block, rather than
+    // skipping the next op.
+    bool skip_exits = false;
+    // For ops which set VF as a flag (8XY4, 8XY5, 8XY7, DXYN): whether a
+    // later op overwrites VF before anything reads it, so the flag needn't be
+    // set.
+    bool dead_flag = false;
+    // The number of Chip8 instructions the op runs, at least. The wait ops
+    // run as many as are left in the frame.
+    unsigned char instructions = 1;
+    // How many instructions must be left in the frame after this op for it to
+    // run. An op which leaves out a write that a later op overwrites only runs
+    // if the ops up to that one are sure to run too, so a block never stops
+    // at the end of a frame with a register missing a value.
+    unsigned char reserve = 0;
+  };
+
+  struct Block {
+    uint16_t start = 0;
+    // Where the program carries on from if it runs past the last op.
+    uint16_t end = 0;
+    Tier tier = kDecoded;
+    bool live = false;
+    std::vector<MicroOp> ops;
+    // The address and value of each instruction the block was compiled from.
+    std::vector<std::pair<uint16_t, uint16_t>> source;
+    int64_t entries = 0;
+    int64_t instructions = 0;
+  };
+
+  // Blocks are only started below this so both bytes of every instruction are
+  // in memory.
+  static constexpr int kMaxAddress = sizeof(Chip8State::memory) - 1;
+  static constexpr int kMaxBlockInstructions = 32;
+  static constexpr int kMaxSkipBias = 1024;
+  static constexpr const char* kProfileHeader = "chip8-block-profile 1";
+
+  // Ops which skip the next op when their condition holds.
+  static bool IsSkip(Op op) {
+    switch (op) {
+    case Op::kSkipEqual:
+    case Op::kSkipNotEqual:
+    case Op::kSkipEqualRegister:
+    case Op::kSkipNotEqualRegister:
+    case Op::kSkipKey:
+    case Op::kSkipNotKey:
+    case Op::kAddSkipEqual:
+    case Op::kAddSkipNotEqual:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Whether the op after `op` is skipped over within the block.
+  static bool Skippable(const MicroOp& op) {
+    return IsSkip(op.op) && !op.skip_exits;
+  }
+
+  // Ops which leave the block.
+  static bool IsExit(Op op) {
+    return op == Op::kReturn || op == Op::kJump || op == Op::kLoop ||
+           op == Op::kCall || op == Op::kJumpOffset;
+  }
+
+  // Decodes the instruction at `pc`. Returns false for instructions which are
+  // left to the interpreter: FX0A, which can stall, and instructions which
+  // fault.
+  static bool Decode(const std::array<unsigned char, 4096>& memory, int pc,
+                     MicroOp& op) {
+    uint16_t instruction = (memory[pc] << 8) | memory[pc + 1];
+    op.pc = pc;
+    op.x = (instruction & 0x0F00) >> 8;
+    op.y = (instruction & 0x00F0) >> 4;
+    op.n = instruction & 0x000F;
+    op.constant = instruction & 0x00FF;
+    auto address = instruction & 0x0FFF;
+    switch (instruction & 0xF000) {
+    case 0x0000:
+      if (instruction == 0x00E0) {
+        op.op = Op::kClear;
+      } else if (instruction == 0x00EE) {
+        op.op = Op::kReturn;
+      } else {
+        return false;
+      }
+      return true;
+    case 0x1000:
+      op.op = Op::kJump;
+      op.constant = address;
+      return true;
+    case 0x2000:
+      op.op = Op::kCall;
+      op.constant = address;
+      return true;
+    case 0x3000:
+      op.op = Op::kSkipEqual;
+      return true;
+    case 0x4000:
+      op.op = Op::kSkipNotEqual;
+      return true;
+    case 0x5000:
+      op.op = Op::kSkipEqualRegister;
+      return true;
+    case 0x6000:
+      op.op = Op::kSet;
+      return true;
+    case 0x7000:
+      op.op = Op::kAdd;
+      return true;
+    case 0x8000: {
+      static constexpr Op kArithmetic[] = {
+          Op::kMove,        Op::kOr,          Op::kAnd,
+          Op::kXor,         Op::kAddRegister, Op::kSubtract,
+          Op::kShiftRight,  Op::kSubtractReverse};
+      if (op.n < 8) {
+        op.op = kArithmetic[op.n];
+      } else if (op.n == 0xE) {
+        op.op = Op::kShiftLeft;
+      } else {
+        return false;
+      }
+      return true;
+    }
+    case 0x9000:
+      op.op = Op::kSkipNotEqualRegister;
+      return true;
+    case 0xA000:
+      op.op = Op::kSetIndex;
+      op.constant = address;
+      return true;
+    case 0xB000:
+      op.op = Op::kJumpOffset;
+      op.constant = address;
+      return true;
+    case 0xC000:
+      op.op = Op::kRandom;
+      return true;
+    case 0xD000:
+      op.op = Op::kDraw;
+      return true;
+    case 0xE000:
+      if (op.constant == 0x9E) {
+        op.op = Op::kSkipKey;
+      } else if (op.constant == 0xA1) {
+        op.op = Op::kSkipNotKey;
+      } else {
+        return false;
+      }
+      return true;
+    case 0xF000:
+      switch (op.constant) {
+      case 0x07:
+        op.op = Op::kGetDelay;
+        return true;
+      case 0x15:
+        op.op = Op::kSetDelay;
+        return true;
+      case 0x18:
+        op.op = Op::kSetSound;
+        return true;
+      case 0x02:
+        op.op = Op::kLoadAudioPattern;
+        return true;
+      case 0x3A:
+        op.op = Op::kSetPitch;
+        return true;
+      case 0x1E:
+        op.op = Op::kAddIndex;
+        return true;
+      case 0x29:
+        op.op = Op::kFontCharacter;
+        return true;
+      case 0x33:
+        op.op = Op::kStoreDecimal;
+        return true;
+      case 0x55:
+        op.op = Op::kStoreRegisters;
+        return true;
+      case 0x65:
+        op.op = Op::kLoadRegisters;
+        return true;
+      }
+      return false;
+    }
+    return false;
+  }
+
+  // Replaces pairs of ops which are common in Chip8 programs with single
+  // fused ops. An op which can be skipped is never fused, since skips jump
+  // over exactly one instruction.
+  static std::vector<MicroOp> Fuse(const std::vector<MicroOp>& ops) {
+    std::vector<MicroOp> fused;
+    for (size_t i = 0; i < ops.size(); ++i) {
+      auto op = ops[i];
+      bool skippable = i > 0 && Skippable(ops[i - 1]);
+      if (i + 2 < ops.size() && !skippable && op.op == Op::kGetDelay &&
+          (ops[i + 1].op == Op::kSkipEqual ||
+           ops[i + 1].op == Op::kSkipNotEqual) &&
+          ops[i + 1].x == op.x && ops[i + 2].op == Op::kLoop &&
+          ops[i + 2].constant == op.pc) {
+        op.op = Op::kWaitDelay;
+        op.constant = ops[i + 1].constant;
+        op.n = ops[i + 1].op == Op::kSkipEqual;
+        i += 2;
+      } else if (i + 1 < ops.size() && !skippable &&
+                 (op.op == Op::kSkipKey || op.op == Op::kSkipNotKey) &&
+                 ops[i + 1].op == Op::kLoop && ops[i + 1].constant == op.pc) {
+        op.n = op.op == Op::kSkipKey;
+        op.op = Op::kWaitKey;
+        ++i;
+      } else if (i + 1 < ops.size() && !skippable) {
+        auto& next = ops[i + 1];
+        if (op.op == Op::kSetIndex && next.op == Op::kDraw) {
+          op.op = Op::kSetIndexDraw;
+          op.instructions = 2;
+          op.x = next.x;
+          op.y = next.y;
+          op.n = next.n;
+          ++i;
+        } else if (op.op == Op::kSet && next.op == Op::kSet) {
+          op.op = Op::kSetPair;
+          op.instructions = 2;
+          op.y = next.x;
+          op.n = next.constant;
+          ++i;
+        } else if (op.op == Op::kAdd &&
+                   (next.op == Op::kSkipEqual ||
+                    next.op == Op::kSkipNotEqual) &&
+                   next.x == op.x) {
+          op.op = next.op == Op::kSkipEqual ? Op::kAddSkipEqual
+                                            : Op::kAddSkipNotEqual;
+          op.instructions = 2;
+          op.n = next.constant;
+          op.skip_exits = next.skip_exits;
+          ++i;
+        }
+      }
+      fused.push_back(op);
+    }
+    return fused;
+  }
+
+  // Compiles the code at `pc` into a block of `tier`. Returns false if there
+  // was nothing to compile.
+  bool Compile(const std::array<unsigned char, 4096>& memory, int pc,
+               Tier tier) {
+    std::vector<MicroOp> ops;
+    std::vector<std::pair<uint16_t, uint16_t>> source;
+    std::bitset<sizeof(Chip8State::memory)> visited;
+    int address = pc;
+    MicroOp op;
+    while (address < kMaxAddress &&
+           int(ops.size()) < kMaxBlockInstructions) {
+      if (visited[address]) {
+        // Running back into a jump that was followed earlier (e.g. when the
+        // block starts on the jump at the bottom of a loop) goes round the
+        // loop.
+        auto earlier = std::find_if(ops.begin(), ops.end(), [&](auto& op) {
+          return op.pc == address;
+        });
+        if (earlier->op == Op::kFollowJump) {
+          op = *earlier;
+          op.op = Op::kLoop;
+          ops.push_back(op);
+          address += 2;
+        }
+        break;
+      }
+      if (!Decode(memory, address, op)) {
+        break;
+      }
+      visited[address] = true;
+      source.emplace_back(address,
+                          (memory[address] << 8) | memory[address + 1]);
+      // A skip over a jump is a conditional branch, and the block can only
+      // carry on down one side of it. Normally that's the code the skip lands
+      // on and the jump leaves the block, but when the skip is usually not
+      // taken the block follows the jump and taking the skip leaves instead.
+      bool skippable = !ops.empty() && Skippable(ops.back());
+      if (op.op == Op::kJump && skippable && skip_bias_[ops.back().pc] < 0) {
+        ops.back().skip_exits = true;
+        skippable = false;
+      }
+      if (op.op == Op::kJump && !skippable && op.constant < kMaxAddress &&
+          !visited[op.constant]) {
+        op.op = Op::kFollowJump;
+        ops.push_back(op);
+        address = op.constant;
+        continue;
+      }
+      if (op.op == Op::kJump && op.constant < kMaxAddress &&
+          visited[op.constant]) {
+        op.op = Op::kLoop;
+      }
+      ops.push_back(op);
+      address += 2;
+      // A skip followed by an exit is a conditional branch; the block carries
+      // on with the code that the skip lands on.
+      if (IsExit(op.op) && !skippable) {
+        break;
+      }
+    }
+    if (ops.empty()) {
+      return false;
+    }
+    int end = address;
+    if (ops.back().op == Op::kFollowJump) {
+      // There's no next op for the jump to fall into.
+      ops.back().op = Op::kJump;
+    }
+
+    // A block being recompiled keeps its place and its counts.
+    int index = block_at_[pc];
+    if (index < 0) {
+      if (free_blocks_.empty()) {
+        index = blocks_.size();
+        blocks_.emplace_back();
+      } else {
+        index = free_blocks_.back();
+        free_blocks_.pop_back();
+      }
+      blocks_[index].entries = 0;
+      blocks_[index].instructions = 0;
+    }
+    auto& block = blocks_[index];
+    block.start = pc;
+    block.end = end;
+    block.tier = tier;
+    block.live = true;
+    block.ops = tier == kFused ? Fuse(ops) : std::move(ops);
+    LinkLoops(block.ops);
+    if (tier == kFused) {
+      stats_.constants_folded += FoldConstants(block.ops);
+    }
+    stats_.dead_writes += EliminateDeadWrites(block.ops);
+    block.source = std::move(source);
+    block_at_[pc] = index;
+    MarkCode(block);
+    ++stats_.blocks_compiled[tier];
+    return true;
+  }
+
+  // Points each loop at the op it jumps back to. A loop into the middle of a
+  // fused op has to leave the block instead.
+  static void LinkLoops(std::vector<MicroOp>& ops) {
+    for (auto& op : ops) {
+      if (op.op != Op::kLoop) {
+        continue;
+      }
+      op.op = Op::kJump;
+      for (size_t i = 0; i < ops.size(); ++i) {
+        if (ops[i].pc == op.constant) {
+          op.op = Op::kLoop;
+          op.n = i;
+        }
+      }
+    }
+  }
+
+  // Whether `op` reads register `r` (from before the op), or might.
+  static bool Reads(const MicroOp& op, int r) {
+    switch (op.op) {
+    case Op::kNop:
+    case Op::kClear:
+    case Op::kFollowJump:
+    case Op::kSet:
+    case Op::kSetIndex:
+    case Op::kRandom:
+    case Op::kDrawAt:
+    case Op::kGetDelay:
+    case Op::kLoadAudioPattern:
+    case Op::kLoadRegisters:
+    case Op::kSetIndexDrawAt:
+    case Op::kSetPair:
+      return false;
+    case Op::kSkipEqual:
+    case Op::kSkipNotEqual:
+    case Op::kAdd:
+    case Op::kShiftRight:
+    case Op::kShiftLeft:
+    case Op::kSkipKey:
+    case Op::kSkipNotKey:
+    case Op::kSetDelay:
+    case Op::kSetSound:
+    case Op::kSetPitch:
+    case Op::kAddIndex:
+    case Op::kFontCharacter:
+    case Op::kStoreDecimal:
+    case Op::kAddSkipEqual:
+    case Op::kAddSkipNotEqual:
+      return r == op.x;
+    case Op::kMove:
+      return r == op.y;
+    case Op::kSkipEqualRegister:
+    case Op::kSkipNotEqualRegister:
+    case Op::kOr:
+    case Op::kAnd:
+    case Op::kXor:
+    case Op::kAddRegister:
+    case Op::kSubtract:
+    case Op::kSubtractReverse:
+    case Op::kDraw:
+    case Op::kSetIndexDraw:
+      return r == op.x || r == op.y;
+    case Op::kStoreRegisters:
+      return r <= op.x;
+    default:
+      // The ops which leave the block, and the waits, which can too.
+      return true;
+    }
+  }
+
+  // Whether `op` writes register `r`.
+  static bool Writes(const MicroOp& op, int r) {
+    constexpr int kFlag = 0xF;
+    switch (op.op) {
+    case Op::kSet:
+    case Op::kAdd:
+    case Op::kMove:
+    case Op::kOr:
+    case Op::kAnd:
+    case Op::kXor:
+    case Op::kShiftRight:
+    case Op::kShiftLeft:
+    case Op::kRandom:
+    case Op::kGetDelay:
+    case Op::kAddSkipEqual:
+    case Op::kAddSkipNotEqual:
+    case Op::kWaitDelay:
+      return r == op.x;
+    case Op::kAddRegister:
+    case Op::kSubtract:
+    case Op::kSubtractReverse:
+      return r == op.x || (r == kFlag && !op.dead_flag);
+    case Op::kDraw:
+    case Op::kDrawAt:
+    case Op::kSetIndexDraw:
+    case Op::kSetIndexDrawAt:
+      return r == kFlag && !op.dead_flag;
+    case Op::kSetPair:
+      return r == op.x || r == op.y;
+    case Op::kLoadRegisters:
+      return r <= op.x;
+    default:
+      return false;
+    }
+  }
+
+  // Returns the index of the op after `ops[i]` which overwrites register `r`
+  // before anything can read it, or -1 if the value might be used. Only code
+  // which is sure to run straight through is looked at, so the search stops
+  // at skips (which might skip the write), at ops which can leave the block
+  // and at stores (after which the block might be dropped).
+  static int FindOverwrite(const std::vector<MicroOp>& ops, int i, int r) {
+    for (int j = i + 1; j < int(ops.size()); ++j) {
+      auto& op = ops[j];
+      if (Reads(op, r)) {
+        return -1;
+      }
+      if (Writes(op, r)) {
+        return j;
+      }
+      if (IsSkip(op.op) || op.op == Op::kStoreDecimal ||
+          op.op == Op::kStoreRegisters) {
+        return -1;
+      }
+    }
+    return -1;
+  }
+
+  // Removes writes to registers which later ops overwrite before anything
+  // reads them: flags which are never looked at (e.g. a DXYN followed by
+  // another), and register writes left over by `FoldConstants`. Each op that
+  // loses a write reserves enough of the frame for the ops up to the one which
+  // overwrites it. Works backwards so chains of removed writes (e.g. a run of
+  // DXYNs) reserve all the way to the last op. Returns the number of writes
+  // removed.
+  static int EliminateDeadWrites(std::vector<MicroOp>& ops) {
+    constexpr int kFlag = 0xF;
+    int removed = 0;
+    for (int i = int(ops.size()) - 2; i >= 0; --i) {
+      auto& op = ops[i];
+      int last = -1;
+      auto dead = [&](int r) {
+        int j = FindOverwrite(ops, i, r);
+        if (j < 0) {
+          return false;
+        }
+        last = std::max(last, j);
+        ++removed;
+        return true;
+      };
+      switch (op.op) {
+      case Op::kAddRegister:
+      case Op::kSubtract:
+      case Op::kSubtractReverse:
+      case Op::kDraw:
+      case Op::kDrawAt:
+      case Op::kSetIndexDraw:
+      case Op::kSetIndexDrawAt:
+        op.dead_flag = dead(kFlag);
+        break;
+      case Op::kSet:
+      case Op::kAdd:
+      case Op::kMove:
+      case Op::kOr:
+      case Op::kAnd:
+      case Op::kXor:
+      case Op::kShiftRight:
+      case Op::kShiftLeft:
+      case Op::kGetDelay:
+        if (dead(op.x)) {
+          op.op = Op::kNop;
+        }
+        break;
+      case Op::kSetPair: {
+        bool y_dead = dead(op.y);
+        bool x_dead = op.x == op.y ? y_dead : dead(op.x);
+        if (x_dead && y_dead) {
+          op.op = Op::kNop;
+        } else if (x_dead) {
+          op.op = Op::kSet;
+          op.x = op.y;
+          op.constant = op.n;
+        } else if (y_dead) {
+          op.op = Op::kSet;
+        }
+        break;
+      }
+      default:
+        break;
+      }
+      // Every op up to `last` has to be able to start.
+      int needed = 0;
+      int before = 0;
+      for (int j = i + 1; j <= last; ++j) {
+        needed =
+            std::max(needed, before + ops[j].instructions + ops[j].reserve);
+        before += ops[j].instructions;
+      }
+      op.reserve = needed;
+    }
+    return removed;
+  }
+
+  // Folds registers whose values are known, from 6XNN and the like earlier in
+  // the block, into the ops which use them: e.g. 6000, 6108, D015 draws at
+  // 0, 8 without reading V0 and V1, and 6002, F01E adds 2 to I. A register
+  // which was only known to be constant because of code the block skipped
+  // over is then left to `EliminateDeadWrites`. What's known is forgotten at
+  // the ops a loop jumps back to, and after an op that might be skipped.
+  // Returns the number of ops folded.
+  static int FoldConstants(std::vector<MicroOp>& ops) {
+    std::vector<bool> loop_target(ops.size());
+    for (auto& op : ops) {
+      if (op.op == Op::kLoop) {
+        loop_target[op.n] = true;
+      }
+    }
+    // The value of each register and the index register, or -1.
+    std::array<int, 16> v;
+    v.fill(-1);
+    int index = -1;
+    int folded = 0;
+    for (size_t i = 0; i < ops.size(); ++i) {
+      if (loop_target[i]) {
+        v.fill(-1);
+        index = -1;
+      }
+      auto& op = ops[i];
+      folded += FoldConstant(v, index, op);
+      for (int r = 0; r < 16; ++r) {
+        if (Writes(op, r)) {
+          v[r] = -1;
+        }
+      }
+      if (op.op == Op::kAddIndex || op.op == Op::kFontCharacter) {
+        index = -1;
+      }
+      if (i > 0 && Skippable(ops[i - 1])) {
+        if (op.op == Op::kSetIndex || op.op == Op::kSetIndexDraw ||
+            op.op == Op::kSetIndexDrawAt) {
+          index = -1;
+        }
+        continue;
+      }
+      switch (op.op) {
+      case Op::kSet:
+        v[op.x] = op.constant;
+        break;
+      case Op::kSetPair:
+        v[op.x] = op.constant;
+        v[op.y] = op.n;
+        break;
+      case Op::kSetIndex:
+      case Op::kSetIndexDraw:
+      case Op::kSetIndexDrawAt:
+        index = op.constant;
+        break;
+      default:
+        break;
+      }
+    }
+    return folded;
+  }
+
+  // Rewrites `op` using the known register values `v` and index register.
+  // Returns 1 if it did.
+  static int FoldConstant(const std::array<int, 16>& v, int index,
+                          MicroOp& op) {
+    constexpr int kFlag = 0xF;
+    bool x = v[op.x] >= 0;
+    bool y = v[op.y] >= 0;
+    auto set = [&](int value) {
+      op.op = Op::kSet;
+      op.constant = value & 0xFF;
+      return 1;
+    };
+    // An arithmetic op sets VF and then VX, which is what a kSetPair of the
+    // two does.
+    auto set_with_flag = [&](int value, bool flag) {
+      op.op = Op::kSetPair;
+      op.y = op.x;
+      op.n = value & 0xFF;
+      op.x = kFlag;
+      op.constant = flag;
+      return 1;
+    };
+    auto never_skips = [&](bool skips) {
+      if (skips) {
+        return 0;
+      }
+      op.op = Op::kNop;
+      op.skip_exits = false;
+      return 1;
+    };
+    switch (op.op) {
+    case Op::kAdd:
+      return x ? set(v[op.x] + op.constant) : 0;
+    case Op::kMove:
+      return y ? set(v[op.y]) : 0;
+    case Op::kOr:
+      return x && y ? set(v[op.x] | v[op.y]) : 0;
+    case Op::kAnd:
+      return x && y ? set(v[op.x] & v[op.y]) : 0;
+    case Op::kXor:
+      return x && y ? set(v[op.x] ^ v[op.y]) : 0;
+    case Op::kShiftRight:
+      return x ? set(v[op.x] >> 1) : 0;
+    case Op::kShiftLeft:
+      return x ? set(v[op.x] << 1) : 0;
+    case Op::kAddRegister:
+      return x && y ? set_with_flag(v[op.x] + v[op.y],
+                                    v[op.x] + v[op.y] > 0xFF)
+                    : 0;
+    case Op::kSubtract:
+      return x && y ? set_with_flag(v[op.x] - v[op.y], v[op.x] >= v[op.y])
+                    : 0;
+    case Op::kSubtractReverse:
+      return x && y ? set_with_flag(v[op.y] - v[op.x], v[op.y] >= v[op.x])
+                    : 0;
+    case Op::kDraw:
+    case Op::kSetIndexDraw:
+      if (!x || !y) {
+        return 0;
+      }
+      op.op = op.op == Op::kDraw ? Op::kDrawAt : Op::kSetIndexDrawAt;
+      op.x = v[op.x];
+      op.y = v[op.y];
+      return 1;
+    case Op::kAddIndex:
+      if (!x || index < 0) {
+        return 0;
+      }
+      op.op = Op::kSetIndex;
+      op.constant = index + v[op.x];
+      return 1;
+    case Op::kFontCharacter:
+      if (!x) {
+        return 0;
+      }
+      op.op = Op::kSetIndex;
+      op.constant = Chip8Core::kFontAddress +
+                    (v[op.x] & 0x000F) * Chip8Core::kFontCharacterHeight;
+      return 1;
+    case Op::kSkipEqual:
+      return x ? never_skips(v[op.x] == op.constant) : 0;
+    case Op::kSkipNotEqual:
+      return x ? never_skips(v[op.x] != op.constant) : 0;
+    case Op::kSkipEqualRegister:
+      return x && y ? never_skips(v[op.x] == v[op.y]) : 0;
+    case Op::kSkipNotEqualRegister:
+      if (op.x == op.y) {
+        return never_skips(false);
+      }
+      return x && y ? never_skips(v[op.x] != v[op.y]) : 0;
+    case Op::kAddSkipEqual:
+    case Op::kAddSkipNotEqual: {
+      if (!x) {
+        return 0;
+      }
+      int value = (v[op.x] + op.constant) & 0xFF;
+      bool skips = (value == op.n) == (op.op == Op::kAddSkipEqual);
+      return skips ? 0 : set(value);
+    }
+    default:
+      return 0;
+    }
+  }
+
+  void MarkCode(const Block& block) {
+    for (auto [address, instruction] : block.source) {
+      code_[address] = true;
+      code_[address + 1] = true;
+    }
+  }
+
+  // Runs `block` until it ends or `budget` instructions have run, whichever
+  // is first. Returns the number of instructions run.
+  int RunBlock(Chip8Core& core, Block& block, int budget) {
+    auto& state = core.state_;
+    auto& v = state.variable_registers;
+    auto& pc = state.program_counter;
+    ++block.entries;
+    if (block.tier == kDecoded && options_.fuse_threshold > 0 &&
+        block.entries >= options_.fuse_threshold) {
+      // Recompiling replaces `block.ops`, so it only happens once the block
+      // has finished running.
+      promote_ = block.start;
+    }
+
+    // Decoded blocks keep track of which way their skips go for when they
+    // are recompiled.
+    bool track_skips = block.tier == kDecoded;
+    int executed = 0;
+    auto* ops = block.ops.data();
+    int num_ops = block.ops.size();
+    int i = 0;
+    while (i < num_ops) {
+      auto op = ops[i];
+      int instructions = op.instructions;
+      if (executed + instructions + op.reserve > budget) {
+        pc = op.pc;
+        return Finish(block, executed);
+      }
+      executed += instructions;
+      bool skip = false;
+      switch (op.op) {
+      case Op::kNop:
+        break;
+      case Op::kClear:
+        state.display.fill(0);
+        break;
+      case Op::kReturn:
+        pc = op.pc + 2;
+        core.Return();
+        return Finish(block, executed);
+      case Op::kJump:
+        pc = op.constant;
+        return Finish(block, executed);
+      case Op::kFollowJump:
+        break;
+      case Op::kLoop:
+        // Go round again without leaving the block, as long as the frame
+        // isn't over.
+        i = op.n;
+        continue;
+      case Op::kCall:
+        pc = op.pc + 2;
+        core.Call(op.constant);
+        return Finish(block, executed);
+      case Op::kSkipEqual:
+        skip = v[op.x] == op.constant;
+        break;
+      case Op::kSkipNotEqual:
+        skip = v[op.x] != op.constant;
+        break;
+      case Op::kSkipEqualRegister:
+        skip = v[op.x] == v[op.y];
+        break;
+      case Op::kSkipNotEqualRegister:
+        skip = v[op.x] != v[op.y];
+        break;
+      case Op::kSet:
+        v[op.x] = op.constant;
+        break;
+      case Op::kAdd:
+        v[op.x] += op.constant;
+        break;
+      case Op::kMove:
+        v[op.x] = v[op.y];
+        break;
+      case Op::kOr:
+        v[op.x] |= v[op.y];
+        break;
+      case Op::kAnd:
+        v[op.x] &= v[op.y];
+        break;
+      case Op::kXor:
+        v[op.x] ^= v[op.y];
+        break;
+      case Op::kAddRegister:
+        if (op.dead_flag) {
+          v[op.x] += v[op.y];
+        } else {
+          v[op.x] = core.add(v[op.x], v[op.y]);
+        }
+        break;
+      case Op::kSubtract:
+        if (op.dead_flag) {
+          v[op.x] -= v[op.y];
+        } else {
+          v[op.x] = core.subtract(v[op.x], v[op.y]);
+        }
+        break;
+      case Op::kShiftRight:
+        v[op.x] >>= 1;
+        break;
+      case Op::kSubtractReverse:
+        if (op.dead_flag) {
+          v[op.x] = v[op.y] - v[op.x];
+        } else {
+          v[op.x] = core.subtract(v[op.y], v[op.x]);
+        }
+        break;
+      case Op::kShiftLeft:
+        v[op.x] <<= 1;
+        break;
+      case Op::kSetIndex:
+        state.index_register = op.constant;
+        break;
+      case Op::kJumpOffset:
+        pc = op.constant + v[0];
+        return Finish(block, executed);
+      case Op::kRandom:
+        v[op.x] =
+            (CounterRandom(state.random_seed, state.random_counter++) >> 56) &
+            op.constant;
+        break;
+      case Op::kDraw:
+        core.Draw(v[op.x], v[op.y], op.n, !op.dead_flag);
+        break;
+      case Op::kDrawAt:
+        core.Draw(op.x, op.y, op.n, !op.dead_flag);
+        break;
+      case Op::kSkipKey:
+      case Op::kSkipNotKey: {
+        auto key = v[op.x] & 0xF;
+        core.keys_polled_ |= 1 << key;
+        skip = core.IsPressed(key) == (op.op == Op::kSkipKey);
+        break;
+      }
+      case Op::kGetDelay:
+        v[op.x] = state.delay_timer;
+        break;
+      case Op::kSetDelay:
+        state.delay_timer = v[op.x];
+        break;
+      case Op::kSetSound:
+        state.sound_timer = v[op.x];
+        break;
+      case Op::kLoadAudioPattern:
+        for (size_t i = 0; i < state.audio_pattern.size(); ++i) {
+          state.audio_pattern[i] = state.memory[(state.index_register + i) &
+                                                Chip8Core::kAddressMask];
+        }
+        break;
+      case Op::kSetPitch:
+        state.audio_pitch = v[op.x];
+        break;
+      case Op::kAddIndex:
+        state.index_register += v[op.x];
+        break;
+      case Op::kFontCharacter:
+        state.index_register =
+            Chip8Core::kFontAddress +
+            (v[op.x] & 0x000F) * Chip8Core::kFontCharacterHeight;
+        break;
+      case Op::kStoreDecimal:
+      case Op::kStoreRegisters:
+        if (op.op == Op::kStoreDecimal) {
+          core.StoreDecimal(v[op.x]);
+        } else {
+          core.StoreRegisters(op.x);
+        }
+        // The write may have replaced this block's own code, so the rest of
+        // the block can't be trusted.
+        if (CheckWrites(core)) {
+          pc = op.pc + 2;
+          return Finish(block, executed);
+        }
+        break;
+      case Op::kLoadRegisters:
+        for (int i = 0; i <= op.x; ++i) {
+          v[i] = state.memory[(state.index_register + i) &
+                              Chip8Core::kAddressMask];
+        }
+        break;
+      case Op::kSetIndexDraw:
+        state.index_register = op.constant;
+        core.Draw(v[op.x], v[op.y], op.n, !op.dead_flag);
+        break;
+      case Op::kSetIndexDrawAt:
+        state.index_register = op.constant;
+        core.Draw(op.x, op.y, op.n, !op.dead_flag);
+        break;
+      case Op::kSetPair:
+        v[op.x] = op.constant;
+        v[op.y] = op.n;
+        break;
+      case Op::kAddSkipEqual:
+        v[op.x] += op.constant;
+        skip = v[op.x] == op.n;
+        break;
+      case Op::kAddSkipNotEqual:
+        v[op.x] += op.constant;
+        skip = v[op.x] != op.n;
+        break;
+      case Op::kWaitDelay: {
+        v[op.x] = state.delay_timer;
+        if (executed == budget) {
+          pc = op.pc + 2;
+          return Finish(block, executed);
+        }
+        ++executed;
+        if ((v[op.x] == op.constant) == bool(op.n)) {
+          pc = op.pc + 6;
+          return Finish(block, executed);
+        }
+        // The jump, FX07 and skip repeat for the rest of the frame.
+        static constexpr int kNext[] = {4, 0, 2};
+        pc = op.pc + kNext[(budget - executed) % 3];
+        return Finish(block, budget);
+      }
+      case Op::kWaitKey: {
+        auto key = v[op.x] & 0xF;
+        core.keys_polled_ |= 1 << key;
+        if (core.IsPressed(key) == bool(op.n)) {
+          pc = op.pc + 4;
+          return Finish(block, executed);
+        }
+        // The jump and skip repeat for the rest of the frame.
+        pc = op.pc + ((budget - executed) % 2 ? 0 : 2);
+        return Finish(block, budget);
+      }
+      }
+      if (track_skips && IsSkip(op.op)) {
+        auto& bias = skip_bias_[op.pc];
+        bias = std::clamp(bias + (skip ? 1 : -1), -kMaxSkipBias, kMaxSkipBias);
+      }
+      if (!skip) {
+        ++i;
+      } else if (!op.skip_exits) {
+        i += 2;
+      } else {
+        pc = op.pc + 2 * instructions + 2;
+        return Finish(block, executed);
+      }
+    }
+    // Ran past the last op, or skipped over the end of the block.
+    pc = block.end + (i > num_ops ? 2 : 0);
+    return Finish(block, executed);
+  }
+
+  int Finish(Block& block, int executed) {
+    block.instructions += executed;
+    stats_.instructions[block.tier] += executed;
+    if (promote_ >= 0) {
+      int start = promote_;
+      promote_ = -1;
+      if (block_at_[start] >= 0) {
+        Compile(attached_->state_.memory, start, kFused);
+      }
+    }
+    return executed;
+  }
+
+  // Drops the blocks whose code the program has written to since the last
+  // check. Returns true if any were dropped.
+  bool CheckWrites(Chip8Core& core) {
+    if (core.written_end_ <= core.written_begin_) {
+      return false;
+    }
+    int begin = core.written_begin_;
+    int end = std::min<int>(core.written_end_, code_.size());
+    core.written_begin_ = sizeof(Chip8State::memory);
+    core.written_end_ = 0;
+    bool overlaps = false;
+    for (int address = begin; address < end; ++address) {
+      overlaps |= code_[address];
+    }
+    if (!overlaps) {
+      return false;
+    }
+    return Invalidate([&](const Block& block) {
+      for (auto [address, instruction] : block.source) {
+        if (address < end && begin < address + 2) {
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+
+  // Drops the blocks matching `predicate`. Returns true if any were dropped.
+  template <typename Predicate> bool Invalidate(Predicate predicate) {
+    bool dropped = false;
+    code_.reset();
+    for (size_t index = 0; index < blocks_.size(); ++index) {
+      auto& block = blocks_[index];
+      if (!block.live) {
+        continue;
+      }
+      if (predicate(block)) {
+        block.live = false;
+        block_at_[block.start] = -1;
+        free_blocks_.push_back(index);
+        ++stats_.blocks_invalidated;
+        dropped = true;
+      } else {
+        MarkCode(block);
+      }
+    }
+    return dropped;
+  }
+
+  // Starts running `core`, checking the blocks against its memory if it
+  // isn't the core that was run last or its memory has been replaced since.
+  void Attach(Chip8Core& core) {
+    if (attached_ == &core && generation_ == core.generation_) {
+      return;
+    }
+    attached_ = &core;
+    generation_ = core.generation_;
+    core.written_begin_ = sizeof(Chip8State::memory);
+    core.written_end_ = 0;
+    auto& memory = core.state_.memory;
+    Invalidate([&](const Block& block) {
+      for (auto [address, instruction] : block.source) {
+        if (((memory[address] << 8) | memory[address + 1]) != instruction) {
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+
+  BlockEngineOptions options_;
+  Stats stats_;
+  std::vector<Block> blocks_;
+  std::vector<int> free_blocks_;
+  // The block starting at each address, or -1.
+  std::array<int, sizeof(Chip8State::memory)> block_at_;
+  // The addresses which are part of a block.
+  std::bitset<sizeof(Chip8State::memory)> code_;
+  std::array<uint32_t, sizeof(Chip8State::memory)> hits_{};
+  // How often the skip at each address is taken, less how often it isn't.
+  std::array<int, sizeof(Chip8State::memory)> skip_bias_{};
+  // A block to recompile as fused once it has finished running.
+  int promote_ = -1;
+  Chip8Core* attached_ = nullptr;
+  uint32_t generation_ = 0;
+};
+
+#endif /* BLOCK_ENGINE_H */
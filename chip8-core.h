@@ -0,0 +1,662 @@
+#ifndef CHIP8_CORE_H
+#define CHIP8_CORE_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "counter-random.h"
+
+// Why a machine has stopped running. A machine that has faulted stays on the
+// instruction that caused it and `Step` does nothing until it is reset or a
+// snapshot is loaded.
+enum class Chip8Fault : unsigned char {
+  kNone,
+  kUnknownInstruction,
+  // A 2NNN with the stack already full, or a 00EE with it empty, while the
+  // stack policy is `StackPolicy::kHalt`.
+  kStackOverflow,
+  kStackUnderflow,
+};
+
+// What a core does when a game calls a subroutine with the stack already full
+// or returns from one with it empty, which buggy or malicious ROMs do (e.g.
+// through runaway recursion).
+enum class StackPolicy {
+  // Stop with a `Chip8Fault`.
+  kHalt,
+  // Treat the stack as a ring, as some hardware did: a call with the stack
+  // full overwrites the oldest return address and a return with it empty
+  // goes back to the newest stale one.
+  kWrap,
+  // The same as `kWrap`, but counted so that it can be reported; see
+  // `Chip8Core::stack_errors`.
+  kReport,
+};
+
+// All of the state of a Chip8 machine. Keeping it together in a single value
+// type means that a snapshot of the machine is just a copy of this struct,
+// which is what run-ahead (and anything else that needs to rewind) relies on.
+//
+// The layout is kept compact (a little over 4kib) since search workloads keep
+// millions of these around.
+struct Chip8State {
+  // 4kib of RAM memory.
+  std::array<unsigned char, 4096> memory{};
+  // 32x64 display memory, one bit per pixel. Each row is a 64 bit word whose
+  // most significant bit is the leftmost column.
+  std::array<uint64_t, 32> display{};
+  // The return addresses of the subroutines being run, of which there are
+  // `stack_depth`. Entries past the depth are left over from earlier calls.
+  static constexpr int kStackSize = 16;
+  std::array<uint16_t, kStackSize> stack{};
+  unsigned char stack_depth = 0;
+  uint16_t program_counter = 0x200;
+  uint16_t index_register = 0;
+  // 16 1-byte registers.
+  std::array<unsigned char, 16> variable_registers{};
+  unsigned char delay_timer = 0;
+  // A tone plays while the sound timer is above zero. Following XO-CHIP the
+  // tone is a 128 bit (1 bit per sample) pattern played at a rate set by the
+  // pitch register; see `AudioSynth`. The default pattern is a 500hz square
+  // wave for games which don't set their own.
+  unsigned char sound_timer = 0;
+  unsigned char audio_pitch = 64;
+  std::array<unsigned char, 16> audio_pattern = {
+      0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+      0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0};
+  // The stream of random numbers used by CXNN; see `CounterRandom`.
+  uint64_t random_seed = 0;
+  uint64_t random_counter = 0;
+  Chip8Fault fault = Chip8Fault::kNone;
+
+  bool operator==(const Chip8State&) const = default;
+};
+
+// A description of why the machine in `state` stopped, for error messages.
+inline std::string DescribeFault(const Chip8State& state) {
+  std::ostringstream description;
+  switch (state.fault) {
+  case Chip8Fault::kNone:
+    return "running";
+  case Chip8Fault::kUnknownInstruction:
+    description << "unknown instruction 0x" << std::hex << std::setfill('0')
+                << std::setw(2) << int(state.memory[state.program_counter])
+                << std::setw(2)
+                << int(state.memory[(state.program_counter + 1) % 4096])
+                << " at 0x" << std::setw(3) << state.program_counter;
+    break;
+  case Chip8Fault::kStackOverflow:
+    description << "more than " << Chip8State::kStackSize
+                << " nested subroutine calls at 0x" << std::hex
+                << std::setfill('0') << std::setw(3) << state.program_counter;
+    break;
+  case Chip8Fault::kStackUnderflow:
+    description << "return with no subroutine to return from at 0x"
+                << std::hex << std::setfill('0') << std::setw(3)
+                << state.program_counter;
+    break;
+  }
+  return description.str();
+}
+
+// The Chip8 machine itself, without any notion of a window, a keyboard or wall
+// clock time. Input is provided as a bitmask of the Chip8 keys that are held
+// down and time advances by calling `Step` (one instruction) or `RunFrame` (one
+// 60hz frame worth of instructions).
+class Chip8Core {
+public:
+  // Most Chip8 games were made to run at roughly 1 instruction per 2
+  // milliseconds, so a ~17ms (60hz) frame fits 8 instructions.
+  static constexpr int kInstructionsPerFrame = 8;
+  // Chip8 key codes range from 0x0 to 0xF.
+  static constexpr int kNumKeys = 16;
+  static constexpr int kDisplayWidth = 64;
+  static constexpr int kDisplayHeight = 32;
+  // Addresses wrap around at the end of the 4KB of memory, like on the
+  // COSMAC VIP, so no program can read or write outside it however far it
+  // moves the index register or the program counter.
+  static constexpr int kAddressMask = sizeof(Chip8State::memory) - 1;
+
+  Chip8Core() { Reset(); }
+
+  // Puts the machine back into the state it is in when it is first turned on,
+  // with no program loaded.
+  void Reset() {
+    auto random_seed = state_.random_seed;
+    state_ = Chip8State();
+    state_.random_seed = random_seed;
+    rom_size_ = 0;
+    ++generation_;
+    std::copy(kFont.begin(), kFont.end(),
+              state_.memory.begin() + kFontAddress);
+  }
+
+  // The original Chip-8 interpreter stored the first byte of the program
+  // at address 200 and so many programs rely on this. Returns false if the ROM
+  // couldn't be read.
+  bool LoadRom(const std::string& rom_file_path) {
+    return ReloadRom(rom_file_path, /* keep_state = */ true);
+  }
+
+  // Replaces the running program with the ROM at `rom_file_path`. Without
+  // `keep_state` this is the same as turning the machine off and on again with
+  // the new ROM. With `keep_state` only the memory that held the old program is
+  // replaced; registers, the stack, timers, the display and the rest of memory
+  // are left as they were so that the game can carry on from where it was.
+  bool ReloadRom(const std::string& rom_file_path, bool keep_state) {
+    std::vector<unsigned char> rom;
+    if (!ReadRom(rom_file_path, rom)) {
+      return false;
+    }
+    ReloadRom(rom, keep_state);
+    return true;
+  }
+
+  // The same as above for a ROM that has already been read into memory, which
+  // lets many cores share one copy of the file. `rom` must fit in the memory
+  // after 0x200.
+  void LoadRom(const std::vector<unsigned char>& rom) {
+    ReloadRom(rom, /* keep_state = */ true);
+  }
+  void ReloadRom(const std::vector<unsigned char>& rom, bool keep_state) {
+    if (!keep_state) {
+      Reset();
+    }
+    auto program_start = state_.memory.begin() + kProgramAddress;
+    std::fill(program_start, program_start + rom_size_, 0);
+    std::copy(rom.begin(), rom.end(), program_start);
+    rom_size_ = rom.size();
+    ++generation_;
+    // Give a program which had faulted a chance to carry on with the fixed
+    // code.
+    state_.fault = Chip8Fault::kNone;
+  }
+
+  // Reads a whole ROM file, truncated to the memory after 0x200.
+  static bool ReadRom(const std::string& rom_file_path,
+                      std::vector<unsigned char>& rom) {
+    std::ifstream file_stream(rom_file_path, std::ios::binary);
+    if (!file_stream) {
+      return false;
+    }
+    rom.assign(std::istreambuf_iterator<char>(file_stream),
+               std::istreambuf_iterator<char>());
+    rom.resize(
+        std::min(rom.size(), sizeof(Chip8State::memory) - kProgramAddress));
+    return true;
+  }
+
+  // Restarts the random numbers seen by the game from `seed`. Two cores with
+  // the same seed, ROM and input behave identically. This is kept by `Reset`.
+  void Seed(uint64_t seed) {
+    state_.random_seed = seed;
+    state_.random_counter = 0;
+  }
+
+  // Sets what happens when the stack overflows or underflows. This is kept by
+  // `Reset`.
+  void SetStackPolicy(StackPolicy policy) { stack_policy_ = policy; }
+
+  // The number of times the stack has overflowed or underflowed under
+  // `StackPolicy::kReport`.
+  int64_t stack_errors() const { return stack_errors_; }
+
+  // Set which Chip8 keys (0x0-0xF) are currently held down, one bit per key.
+  void SetKeys(uint16_t keys) { keys_ = keys; }
+
+  // Snapshots of the machine. Saving into a snapshot that has been used before
+  // reuses its storage, so taking a snapshot every frame doesn't allocate.
+  const Chip8State& state() const { return state_; }
+  void SaveState(Chip8State& snapshot) const { snapshot = state_; }
+  void LoadState(const Chip8State& snapshot) {
+    state_ = snapshot;
+    ++generation_;
+  }
+
+  // Whether the pixel at `row`, `col` of the display is lit.
+  bool pixel(int row, int col) const {
+    return (state_.display[row] >> (kDisplayWidth - 1 - col)) & 1;
+  }
+
+  // Bitmask of the keys that the game has checked with EX9E/EXA1, which gives
+  // a hint of what the controls for the game are.
+  uint16_t keys_polled() const { return keys_polled_; }
+
+  // True while the game is stuck on FX0A waiting for a key press; until the
+  // keys change running more frames won't do anything but tick the timers.
+  bool waiting_for_key() const { return waiting_for_key_; }
+
+  // Chip8 Instructions commonly come either of form:
+  //   - 0xTXYN or
+  //   - 0xTXNN or
+  //   - 0xTNNN or
+  //   - 0xTXYN
+  // where:
+  //   - T is the type of instruction
+  //   - X and Y are register indicies
+  //   - N[NN] are integer "constants"
+  //
+  // The following functions define common bit masks for accessing parts of
+  // the instructions
+  int register1(uint16_t instruction) { return (instruction & 0x0F00) >> 8; }
+  int register2(uint16_t instruction) { return (instruction & 0x00F0) >> 4; }
+  int constant8(uint16_t instruction) { return (instruction & 0x00FF); }
+  int constant12(uint16_t instruction) { return (instruction & 0x0FFF); }
+
+  // Basic arithmetic functions which properly signal overflow into the 0xF
+  // register.
+  unsigned char add(unsigned char a, unsigned char b) {
+    state_.variable_registers[0xF] = a + b > 0xFF;
+    return a + b;
+  }
+  unsigned char subtract(unsigned char a, unsigned char b) {
+    state_.variable_registers[0xF] = a >= b;
+    return a - b;
+  }
+
+  // Prints the args to std::cout if DEBUG is defined with some common stream
+  // manipulations that aid in debugging hex values.
+  template <typename Arg, typename... Args>
+  void Debug(Arg&& arg, Args&&... args) {
+#ifdef DEBUG
+    std::cout << std::hex << std::setfill('0') << std::setw(4)
+              << std::forward<Arg>(arg);
+    ((std::cout << std::forward<Args>(args)), ...);
+    std::cout << std::endl;
+#endif
+  }
+
+  // Runs one 60hz frame: a frame worth of instructions followed by a tick of
+  // the timers.
+  void RunFrame() {
+    for (int i = 0; i < kInstructionsPerFrame; ++i) {
+      Step();
+    }
+    TickTimers();
+  }
+
+  // Update the timers, which count down at 60hz.
+  void TickTimers() {
+    if (state_.delay_timer > 0) {
+      state_.delay_timer--;
+    }
+    if (state_.sound_timer > 0) {
+      state_.sound_timer--;
+    }
+  }
+
+  // Executes a single instruction.
+  void Step() {
+    if (state_.fault != Chip8Fault::kNone) {
+      return;
+    }
+    auto& memory = state_.memory;
+    auto& variable_registers = state_.variable_registers;
+    auto& program_counter = state_.program_counter;
+
+    // Each Chip8 instruction is two bytes, so we read the next two bytes of
+    // memory and then mask them into a single value to make handling easier.
+    uint16_t instruction = (memory[program_counter & kAddressMask] << 8) |
+                           (memory[(program_counter + 1) & kAddressMask]);
+    Debug("Instruction 0x", instruction);
+    program_counter += 2;
+
+    switch (instruction & 0xF000) {
+    case (0x0000): {
+      // Return from function instruction.
+      if (instruction == 0x00EE) {
+        Return();
+      } else if (instruction == 0x00E0) {
+        // Clear screen instruction.
+        state_.display.fill(0);
+      } else {
+        // Calls to machine code routines (0NNN) can't be emulated.
+        Fault(Chip8Fault::kUnknownInstruction);
+      }
+      break;
+    }
+
+    // Unconditional jump.
+    case (0x1000): {
+      program_counter = constant12(instruction);
+      break;
+    }
+
+    // Function call instruction.
+    case (0x2000): {
+      Call(constant12(instruction));
+      break;
+    }
+
+    // Jump equal constant.
+    case (0x3000): {
+      if (variable_registers[register1(instruction)] ==
+          constant8(instruction)) {
+        program_counter += 2;
+      }
+      break;
+    }
+
+    // Jump not equal.
+    case (0x4000): {
+      if (variable_registers[register1(instruction)] !=
+          constant8(instruction)) {
+        program_counter += 2;
+      }
+      break;
+    }
+
+    // Jump equal register.
+    case (0x5000): {
+      if (variable_registers[register1(instruction)] ==
+          variable_registers[register2(instruction)]) {
+        program_counter += 2;
+      }
+      break;
+    }
+
+    // Set register.
+    case (0x6000): {
+      variable_registers[register1(instruction)] = constant8(instruction);
+      break;
+    }
+
+    // Add constant to register.
+    case (0x7000): {
+      variable_registers[register1(instruction)] += constant8(instruction);
+      break;
+    }
+
+    // Two register arithmetic.
+    case (0x8000): {
+      auto& vx = variable_registers[register1(instruction)];
+      auto& vy = variable_registers[register2(instruction)];
+      auto flag = instruction & 0x000F;
+      if (flag == 0x0000) {
+        vx = vy;
+      } else if (flag == 0x0001) {
+        vx |= vy;
+      } else if (flag == 0x0002) {
+        vx &= vy;
+      } else if (flag == 0x0003) {
+        vx ^= vy;
+      } else if (flag == 0x0004) {
+        vx = add(vx, vy);
+      } else if (flag == 0x0005) {
+        vx = subtract(vx, vy);
+      } else if (flag == 0x0006) {
+        vx >>= 1;
+      } else if (flag == 0x0007) {
+        vx = subtract(vy, vx);
+      } else if (flag == 0x000E) {
+        vx <<= 1;
+      } else {
+        Fault(Chip8Fault::kUnknownInstruction);
+      }
+      break;
+    }
+
+    // Jump not equal register.
+    case (0x9000): {
+      if (variable_registers[register1(instruction)] !=
+          variable_registers[register2(instruction)]) {
+        program_counter += 2;
+      }
+      break;
+    }
+
+    // Index register set.
+    case (0xA000): {
+      state_.index_register = constant12(instruction);
+      break;
+    }
+
+    // Jump by offset.
+    case (0xB000): {
+      program_counter = constant12(instruction) + variable_registers[0];
+      break;
+    }
+
+    // Generate random.
+    case (0xC000): {
+      variable_registers[register1(instruction)] =
+          (CounterRandom(state_.random_seed, state_.random_counter++) >> 56) &
+          constant8(instruction);
+      break;
+    }
+
+    // Draws the bitmap sprite pointed to by the index register to the
+    // screen.
+    case (0xD000): {
+      Draw(variable_registers[register1(instruction)],
+           variable_registers[register2(instruction)], instruction & 0x000F);
+      break;
+    }
+
+    // Skip instructions based on key state.
+    case (0xE000): {
+      if ((instruction & 0x00FF) != 0x009E &&
+          (instruction & 0x00FF) != 0x00A1) {
+        Fault(Chip8Fault::kUnknownInstruction);
+        break;
+      }
+      auto skip_state = (instruction & 0x00FF) == 0X009E;
+      auto key = variable_registers[register1(instruction)] & 0xF;
+      keys_polled_ |= 1 << key;
+      if (IsPressed(key) == skip_state) {
+        program_counter += 2;
+      }
+      break;
+    }
+
+    // The F* instructions are a bit of grab bag...
+    case (0xF000): {
+      auto flag = instruction & 0x00FF;
+      if (flag == 0x0007) {
+        variable_registers[register1(instruction)] = state_.delay_timer;
+      } else if (flag == 0x0015) {
+        state_.delay_timer = variable_registers[register1(instruction)];
+      } else if (flag == 0x0018) {
+        state_.sound_timer = variable_registers[register1(instruction)];
+      } else if (flag == 0x0002) {
+        // XO-CHIP: load the audio pattern.
+        for (size_t i = 0; i < state_.audio_pattern.size(); ++i) {
+          state_.audio_pattern[i] =
+              memory[(state_.index_register + i) & kAddressMask];
+        }
+      } else if (flag == 0x003A) {
+        // XO-CHIP: set the audio pitch.
+        state_.audio_pitch = variable_registers[register1(instruction)];
+      } else if (flag == 0x000A) {
+        waiting_for_key_ = !IsPressed(0);
+        if (waiting_for_key_) {
+          program_counter -= 2;
+        } else {
+          variable_registers[register1(instruction)] = 0;
+        }
+      } else if (flag == 0x001E) {
+        state_.index_register += variable_registers[register1(instruction)];
+      } else if (flag == 0x0029) {
+        state_.index_register =
+            kFontAddress +
+            (variable_registers[register1(instruction)] & 0x000F) *
+                kFontCharacterHeight;
+      } else if (flag == 0x0033) {
+        StoreDecimal(variable_registers[register1(instruction)]);
+      } else if (flag == 0x0055) {
+        StoreRegisters(register1(instruction));
+      } else if (flag == 0x0065) {
+        for (int i = 0; i <= register1(instruction); ++i) {
+          variable_registers[i] =
+              memory[(state_.index_register + i) & kAddressMask];
+        }
+      } else {
+        Fault(Chip8Fault::kUnknownInstruction);
+      }
+      break;
+    }
+    }
+    // Jumps (BNNN) and skips near the end of memory can go past it.
+    program_counter &= kAddressMask;
+  }
+
+private:
+  static constexpr int kProgramAddress = 0x200;
+
+  bool IsPressed(int key) { return (keys_ >> key) & 1; }
+
+  // Draws the `height` rows of the sprite at the index register with its top
+  // left corner at `x`, `y`. Without `set_flag`, VF isn't set to whether any
+  // pixels were erased, for callers which know it'll be overwritten unread.
+  void Draw(int x, int y, int height, bool set_flag = true) {
+    auto& display = state_.display;
+    auto row_start = y % 32;
+    auto col_start = x % 64;
+    if (set_flag) {
+      state_.variable_registers[0xF] = 0;
+    }
+
+    for (int sprite_row_offset = 0; sprite_row_offset < height;
+         ++sprite_row_offset) {
+      auto row = row_start + sprite_row_offset;
+      if (row >= kDisplayHeight) {
+        break;
+      }
+
+      // Line the sprite's 8 pixels up with the display row. Any pixels
+      // shifted past the right edge of the screen are dropped.
+      uint64_t sprite_row =
+          uint64_t(state_.memory[(state_.index_register + sprite_row_offset) &
+                                 kAddressMask])
+          << (kDisplayWidth - 8) >> col_start;
+      if (set_flag && (display[row] & sprite_row)) {
+        state_.variable_registers[0xF] = 1;
+      }
+      display[row] ^= sprite_row;
+    }
+  }
+
+  // The instructions which write to memory. The range of memory written is
+  // kept so that anything holding on to decoded code (see `BlockEngine`)
+  // knows when it has been overwritten.
+  void StoreDecimal(unsigned char value) {
+    auto address = state_.index_register & kAddressMask;
+    state_.memory[address] = value / 100;
+    value %= 100;
+    state_.memory[(address + 1) & kAddressMask] = value / 10;
+    state_.memory[(address + 2) & kAddressMask] = value % 10;
+    NoteWrite(address, 3);
+  }
+  void StoreRegisters(int last_register) {
+    auto address = state_.index_register & kAddressMask;
+    for (int i = 0; i <= last_register; ++i) {
+      state_.memory[(address + i) & kAddressMask] =
+          state_.variable_registers[i];
+    }
+    NoteWrite(address, last_register + 1);
+  }
+  void NoteWrite(int address, int size) {
+    // A write which runs off the end of memory carries on at the start.
+    if (address + size > kAddressMask + 1) {
+      NoteWrite(0, address + size - (kAddressMask + 1));
+      size = kAddressMask + 1 - address;
+    }
+    written_begin_ = std::min(written_begin_, address);
+    written_end_ = std::max(written_end_, address + size);
+  }
+
+  // The stack half of 2NNN and 00EE, run with the program counter already
+  // past the instruction.
+  void Call(uint16_t address) {
+    auto& depth = state_.stack_depth;
+    if (depth == Chip8State::kStackSize) {
+      if (!StackError(Chip8Fault::kStackOverflow)) {
+        return;
+      }
+      depth = 0;
+    }
+    state_.stack[depth++] = state_.program_counter;
+    state_.program_counter = address;
+  }
+  void Return() {
+    auto& depth = state_.stack_depth;
+    if (depth == 0) {
+      if (!StackError(Chip8Fault::kStackUnderflow)) {
+        return;
+      }
+      depth = Chip8State::kStackSize;
+    }
+    state_.program_counter = state_.stack[--depth];
+  }
+
+  // Applies `stack_policy_` to a stack overflow or underflow. Returns false if
+  // the machine halted.
+  bool StackError(Chip8Fault fault) {
+    switch (stack_policy_) {
+    case StackPolicy::kHalt:
+      Fault(fault);
+      return false;
+    case StackPolicy::kReport:
+      ++stack_errors_;
+      break;
+    case StackPolicy::kWrap:
+      break;
+    }
+    return true;
+  }
+
+  // Stops the machine on the instruction that was just fetched.
+  void Fault(Chip8Fault fault) {
+    state_.fault = fault;
+    state_.program_counter -= 2;
+  }
+
+  Chip8State state_;
+  uint16_t keys_ = 0;
+  uint16_t keys_polled_ = 0;
+  bool waiting_for_key_ = false;
+  StackPolicy stack_policy_ = StackPolicy::kHalt;
+  int64_t stack_errors_ = 0;
+  uint16_t rom_size_ = 0;
+  // The range of memory written by the program since `BlockEngine` last
+  // looked, and a count of the times that memory was replaced wholesale.
+  int written_begin_ = sizeof(Chip8State::memory);
+  int written_end_ = 0;
+  uint32_t generation_ = 0;
+
+  friend class BlockEngine;
+
+  // A bitmapped font with characters 0-9 and A-F. Early Chip8 interpreters
+  // stored this font starting at address 0x050. Every core copies it from
+  // this one read only image.
+  static constexpr int kFontAddress = 0x050;
+  static constexpr int kFontCharacterHeight = 5;
+  static constexpr std::array<unsigned char, 80> kFont = {
+      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+      0x20, 0x60, 0x20, 0x20, 0x70, // 1
+      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+  };
+};
+
+#endif /* CHIP8_CORE_H */
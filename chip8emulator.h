@@ -1,37 +1,137 @@
-#include <fstream>
-#include <iomanip>
+#include <algorithm>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "audio.h"
+#include "block-engine.h"
+#include "chip8-core.h"
 #include "clock-regulator.h"
+#include "coverage-map.h"
+#include "debug-console.h"
+#include "netplay.h"
+#include "perf-hud.h"
+#include "profile-cache.h"
+#include "replay-file.h"
+#include "rom-watcher.h"
+#include "save-slots.h"
 #include "screen.h"
+#include "startup-timer.h"
+#include "time-travel.h"
+
+// Settings for the emulator which can be changed from the command line.
+struct EmulatorOptions {
+  // The seed for the game's random numbers. Without one a random seed is
+  // picked, except in netplay where both players must use the same seed.
+  std::optional<uint64_t> seed;
+
+  // When greater than 0, each frame is presented as it will look this many
+  // frames into the future assuming the current input is held. This hides the
+  // frame(s) of lag that most games have between reading input and drawing.
+  int run_ahead_frames = 0;
+
+  // When `netplay_port` is set, play against a peer at
+  // `netplay_peer_host`:`netplay_peer_port` who is listening on the port that
+  // we send to and sending to `netplay_port`.
+  int netplay_port = 0;
+  std::string netplay_peer_host;
+  int netplay_peer_port = 0;
+
+  // Reload the ROM whenever the file changes. With `watch_rom_keep_state` the
+  // game carries on with its current registers and memory (other than the
+  // program itself) rather than restarting.
+  bool watch_rom = false;
+  bool watch_rom_keep_state = false;
+
+  // When set, the game's audio is also recorded to this WAV file.
+  std::string record_wav_path;
+
+  // When code is promoted between the tiers of the block engine, and whether
+  // to print the engine's statistics when the window is closed.
+  BlockEngineOptions engine;
+  bool print_engine_stats = false;
+
+  // Start with the blocks that were hot the last time this ROM was played,
+  // from a profile in `profile_directory`, and update the profile on exit.
+  bool use_profile = true;
+  std::string profile_directory = ProfileCache::DefaultDirectory();
+
+  // Print how long each phase of starting up took once the first frame is
+  // on screen.
+  bool print_startup_times = false;
+
+  // Where F1-F4 save the game and F5-F8 load it back.
+  std::string save_directory = SaveSlots::DefaultDirectory();
+
+  // Read debugger commands from stdin, including ones which run the game
+  // backwards; see `DebugConsole`.
+  bool debug = false;
+
+  // Record the game to a replay file, or play one back instead of the game.
+  std::string record_replay_path;
+  std::string play_replay_path;
+
+  // Show how fast the emulator is running in the status bar. "H" toggles it.
+  bool show_perf_hud = false;
+
+  // Print how late each frame started, as a histogram, when the window is
+  // closed; see `ClockRegulator`.
+  bool print_clock_stats = false;
+
+  // When set, which parts of the ROM ran is recorded and a report written to
+  // this file on exit; see `CoverageMap`. Not available with netplay or the
+  // debugger.
+  std::string coverage_path;
+
+  // What happens when the game's stack overflows or underflows.
+  StackPolicy stack_policy = StackPolicy::kHalt;
+};
 
 class Chip8Emulator {
 public:
-  Chip8Emulator(const std::string& rom_file_path)
-      // Initialize 4kib of RAM memory and 16 1-byte registers.
-      : memory_(4096, 0), variable_registers_(16, 0),
-        screen_("Chip 8 Emulator"),
-        // Execute at most 1 instruction per 2 milliseconds to emulate the speed
-        // at which most Chip8 games were made to be run at. Without clock
-        // regulation the games run way to fast.
-        cpu_clock_regulator_(/* milliseconds_per_cycle = */ 2),
-        // Draw the screen once per 17ms (~60hz).
-        draw_screen_regulator_(/* milliseconds_per_cycle = */ 17) {
-    // The original Chip-8 interpreter stored the first byte of the program
-    // at address 200 and so many programs rely on this.
-    std::ifstream file_stream(rom_file_path);
-    for (int program_load_location = 0x200; file_stream;
-         ++program_load_location) {
-      file_stream.read((char*)&memory_[program_load_location], 1);
-    }
-
-    // Initialize the display memory to 32x64 of all zeros.
-    for (int row = 0; row < 32; ++row) {
-      std::vector<unsigned char> columns(64, 0);
-      display_.push_back(std::move(columns));
+  Chip8Emulator(const std::string& rom_file_path,
+                const EmulatorOptions& options = {})
+      : options_(options), rom_file_path_(rom_file_path),
+        engine_(options.engine),
+        // The ROM is loaded on another thread while the window is opened,
+        // which takes far longer.
+        game_loaded_(std::async(std::launch::async, [this]() { LoadGame(); })),
+        screen_("Chip 8 Emulator", &startup_timer_),
+        // Emulate one frame per 17ms (~60hz). Without clock regulation the
+        // games run way to fast.
+        frame_regulator_(kMillisecondsPerFrame),
+        perf_hud_(std::chrono::milliseconds(kMillisecondsPerFrame)),
+        show_perf_hud_(options.show_perf_hud) {
+    auto begin = StartupTimer::Clock::now();
+    game_loaded_.get();
+    startup_timer_.Record("wait for ROM", begin);
+
+    if (options_.watch_rom) {
+      rom_watcher_ = std::make_unique<RomWatcher>(rom_file_path);
+    }
+    if (!options_.record_wav_path.empty()) {
+      wav_recorder_ = std::make_unique<WavRecorder>(options_.record_wav_path);
+      if (!wav_recorder_->ok()) {
+        std::cout << "Failed to open " << options_.record_wav_path << std::endl;
+        wav_recorder_.reset();
+      }
+    }
+
+    if (options_.netplay_port != 0) {
+      auto transport = std::make_unique<UdpTransport>(
+          options_.netplay_port, options_.netplay_peer_host,
+          options_.netplay_peer_port);
+      if (transport->ok()) {
+        netplay_transport_ = std::move(transport);
+        netplay_ =
+            std::make_unique<RollbackSession>(core_, *netplay_transport_);
+      }
     }
 
     // Chip8 key codes range from 0x0 to 0xF (0-15). This mapping stores the
@@ -58,345 +158,330 @@ public:
         SDL_SCANCODE_V,
     };
 
-    // A bitmapped font with characters 0-9 and A-F. Early Chip8 interpreters
-    // stored this font starting at address 0x050.
-    int font_load_location = font_address_;
-    for (const auto font_byte : {
-             0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-             0x20, 0x60, 0x20, 0x20, 0x70, // 1
-             0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-             0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-             0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-             0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-             0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-             0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-             0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-             0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-             0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-             0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-             0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-             0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-             0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-             0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-         }) {
-      memory_[font_load_location] = font_byte;
-      ++font_load_location;
-    }
-
-    // Register the "P" key to pause the game.
-    screen_.OnKeyDown(SDL_SCANCODE_P, [this]() { paused_ = !paused_; });
-  }
+    if (!options_.play_replay_path.empty() && !netplay_) {
+      replay_ = std::make_unique<ReplayFile>();
+      if (!replay_->Open(options_.play_replay_path)) {
+        std::cout << "Failed to read the replay " << options_.play_replay_path
+                  << std::endl;
+        replay_.reset();
+      } else {
+        if (replay_->rom_hash() != HashRom(rom_)) {
+          std::cout << "The replay was recorded with a different ROM"
+                    << std::endl;
+        }
+        SeekReplay(0);
+      }
+    } else if (!options_.record_replay_path.empty() && !netplay_ &&
+               !options_.debug) {
+      replay_recorder_ =
+          std::make_unique<ReplayRecorder>(options_.record_replay_path, rom_);
+      if (!replay_recorder_->ok()) {
+        std::cout << "Failed to open " << options_.record_replay_path
+                  << std::endl;
+        replay_recorder_.reset();
+      }
+    }
 
-  // Chip8 Instructions commonly come either of form:
-  //   - 0xTXYN or
-  //   - 0xTXNN or
-  //   - 0xTNNN or
-  //   - 0xTXYN
-  // where:
-  //   - T is the type of instruction
-  //   - X and Y are register indicies
-  //   - N[NN] are integer "constants"
-  //
-  // The following functions define common bit masks for accessing parts of
-  // the instructions
-  int register1(uint16_t instruction) { return (instruction & 0x0F00) >> 8; }
-  int register2(uint16_t instruction) { return (instruction & 0x00F0) >> 4; }
-  int constant8(uint16_t instruction) { return (instruction & 0x00FF); }
-  int constant12(uint16_t instruction) { return (instruction & 0x0FFF); }
-
-  // Basic arithmetic functions which properly signal overflow into the 0xF
-  // register.
-  unsigned char add(unsigned char a, unsigned char b) {
-    variable_registers_[0xF] = a + b > 0xFF;
-    return a + b;
-  }
-  unsigned char subtract(unsigned char a, unsigned char b) {
-    variable_registers_[0xF] = a >= b;
-    return a - b;
-  }
+    if (!options_.coverage_path.empty() && !netplay_ && !options_.debug) {
+      coverage_ = std::make_unique<CoverageMap>();
+    }
+
+    if (options_.debug && !netplay_ && !replay_) {
+      time_travel_ = std::make_unique<TimeTravel>(core_);
+      debug_console_ = std::make_unique<DebugConsole>(core_, *time_travel_);
+    }
 
-  // Prints the args to std::cout if DEBUG is defined with some common stream
-  // manipulations that aid in debugging hex values.
-  template <typename Arg, typename... Args>
-  void Debug(Arg&& arg, Args&&... args) {
-#ifdef DEBUG
-    std::cout << std::hex << std::setfill('0') << std::setw(4)
-              << std::forward<Arg>(arg);
-    ((std::cout << std::forward<Args>(args)), ...);
-    std::cout << std::endl;
-#endif
+    // Register the "P" key to pause the game, and F1-F4 to save it to a slot
+    // and F5-F8 to load it back. The peer can't be paused or rewound, so
+    // netplay games run regardless. Replays are scrubbed through with the
+    // arrow keys instead.
+    if (!netplay_) {
+      screen_.OnKeyDown(SDL_SCANCODE_P, [this]() { paused_ = !paused_; });
+    }
+    if (replay_) {
+      constexpr int kFramesPerSecond = 1000 / kMillisecondsPerFrame;
+      std::pair<SDL_Scancode, int> seeks[] = {
+          {SDL_SCANCODE_LEFT, -5 * kFramesPerSecond},
+          {SDL_SCANCODE_RIGHT, 5 * kFramesPerSecond},
+          {SDL_SCANCODE_DOWN, -60 * kFramesPerSecond},
+          {SDL_SCANCODE_UP, 60 * kFramesPerSecond},
+      };
+      for (auto [key, frames] : seeks) {
+        screen_.OnKeyDown(
+            key, [this, frames]() { SeekReplay(replay_frame_ + frames); });
+      }
+      screen_.OnKeyDown(SDL_SCANCODE_HOME, [this]() { SeekReplay(0); });
+    } else if (!netplay_) {
+      for (int slot = 0; slot < SaveSlots::kNumSlots; ++slot) {
+        screen_.OnKeyDown(SDL_Scancode(SDL_SCANCODE_F1 + slot),
+                          [this, slot]() { SaveSlot(slot); });
+        screen_.OnKeyDown(
+            SDL_Scancode(SDL_SCANCODE_F1 + SaveSlots::kNumSlots + slot),
+            [this, slot]() { LoadSlot(slot); });
+      }
+    }
+    screen_.OnKeyDown(SDL_SCANCODE_H,
+                      [this]() { show_perf_hud_ = !show_perf_hud_; });
   }
 
   // Executes the Chip8 program that was loaded from the file in the
   // constructor. This call will block until the graphics window is closed.
   void BlockingExecute() {
-    while (screen_.PollEvent()) {
-      // Refresh the screen and update the delay timer.
-      if (draw_screen_regulator_.Tick()) {
-        if (!paused_ && delay_timer_ > 0) {
-          delay_timer_--;
-        }
-
-        screen_.Clear(Color::Black());
-        DrawBottomBar();
-        DrawGameDisplay();
-        screen_.Update();
-      }
-
-      // Regulate program instruction processing speed to prevent the game from
-      // running too fast.
-      if (paused_ || !cpu_clock_regulator_.Tick()) {
-        continue;
-      }
-
-      // Each Chip8 instruction is two bytes, so we read the next two bytes of
-      // memory and then mask them into a single value to make handling easier.
-      uint16_t instruction =
-          (memory_[program_counter_] << 8) | (memory_[program_counter_ + 1]);
-      Debug("Instruction 0x", instruction);
-      program_counter_ += 2;
-
-      switch (instruction & 0xF000) {
-      case (0x0000): {
-        auto flag = instruction & 0x000F;
-        // Return from function instruction.
-        if (flag == 0x000E) {
-          program_counter_ = stack_.back();
-          stack_.pop_back();
-        } else if (flag == 0x0000) {
-          // Clear screen instruction.
-          for (auto& row : display_) {
-            for (auto& cell : row) {
-              cell = 0;
-            }
-          }
-        }
-        break;
-      }
-
-      // Unconditional jump.
-      case (0x1000): {
-        program_counter_ = constant12(instruction);
+    while (true) {
+      // Regulate the frame rate to prevent the game from running too fast,
+      // then handle all of the input that arrived while waiting.
+      frame_regulator_.Wait();
+      if (!screen_.PollEvent()) {
         break;
       }
+      perf_hud_.FrameStarted();
+      auto engine_instructions = EngineInstructions();
+      int64_t netplay_instructions = 0;
 
-      // Function call instruction.
-      case (0x2000): {
-        stack_.push_back(program_counter_);
-        program_counter_ = constant12(instruction);
-        break;
+      if (rom_watcher_ && rom_watcher_->Changed()) {
+        core_.ReloadRom(rom_file_path_, options_.watch_rom_keep_state);
+        StateReplaced();
       }
 
-      // Jump equal constant.
-      case (0x3000): {
-        if (variable_registers_[register1(instruction)] ==
-            constant8(instruction)) {
-          program_counter_ += 2;
+      if (netplay_) {
+        if (netplay_->AdvanceFrame(PressedKeys())) {
+          netplay_instructions = Chip8Core::kInstructionsPerFrame;
+          PlayAudio();
         }
-        break;
-      }
-
-      // Jump not equal.
-      case (0x4000): {
-        if (variable_registers_[register1(instruction)] !=
-            constant8(instruction)) {
-          program_counter_ += 2;
+      } else if (replay_) {
+        if (!paused_ && replay_frame_ < replay_->frames()) {
+          core_.SetKeys(replay_->keys(replay_frame_++));
+          RunGameFrame();
+          PlayAudio();
+        }
+      } else {
+        auto keys = PressedKeys();
+        if (replay_recorder_ && !paused_) {
+          replay_recorder_->RecordFrame(core_.state(), keys);
+        }
+        if (debug_console_) {
+          debug_console_->Poll(keys, paused_);
+        }
+        if (!paused_) {
+          if (debug_console_) {
+            debug_console_->RunFrame(keys, engine_, paused_);
+          } else {
+            core_.SetKeys(keys);
+            RunGameFrame();
+          }
+          PlayAudio();
         }
-        break;
       }
+      ReportFault();
 
-      // Jump equal register.
-      case (0x5000): {
-        if (variable_registers_[register1(instruction)] ==
-            variable_registers_[register2(instruction)]) {
-          program_counter_ += 2;
+      screen_.Clear(Color::Black());
+      DrawBottomBar();
+      if (options_.run_ahead_frames > 0 && !paused_) {
+        DrawRunAheadDisplay();
+      } else {
+        DrawGameDisplay();
+      }
+      screen_.Update();
+      // Rollbacks replayed by netplay aren't counted.
+      perf_hud_.FrameFinished(EngineInstructions() - engine_instructions +
+                              netplay_instructions);
+      if (!first_frame_shown_) {
+        first_frame_shown_ = true;
+        if (options_.print_startup_times) {
+          startup_timer_.Report(std::cout, startup_timer_.elapsed());
         }
-        break;
       }
+    }
+    if (options_.print_engine_stats) {
+      engine_.DumpStats(std::cout);
+    }
+    if (options_.print_clock_stats) {
+      frame_regulator_.DumpStats(std::cout);
+    }
+    SaveProfile();
+    if (wav_recorder_ && wav_recorder_->dropped_samples() > 0) {
+      std::cout << "The disk couldn't keep up with the recording: "
+                << wav_recorder_->dropped_samples()
+                << " samples were left out of " << options_.record_wav_path
+                << std::endl;
+    }
+    if (coverage_ && !coverage_->WriteReport(options_.coverage_path, rom_)) {
+      std::cout << "Failed to write " << options_.coverage_path << std::endl;
+    }
+  }
 
-      // Set register.
-      case (0x6000): {
-        variable_registers_[register1(instruction)] = constant8(instruction);
-        break;
+private:
+  // Seeds the game, reads the ROM into the core and compiles the blocks from
+  // its profile.
+  void LoadGame() {
+    auto begin = StartupTimer::Clock::now();
+    core_.SetStackPolicy(options_.stack_policy);
+    if (options_.seed) {
+      core_.Seed(*options_.seed);
+    } else if (options_.netplay_port == 0) {
+      core_.Seed((uint64_t(std::random_device()()) << 32) |
+                 std::random_device()());
+    }
+    if (Chip8Core::ReadRom(rom_file_path_, rom_)) {
+      core_.LoadRom(rom_);
+    }
+    save_slots_ = std::make_unique<SaveSlots>(rom_, options_.save_directory);
+    startup_timer_.Record("load ROM", begin);
+    if (options_.use_profile) {
+      begin = StartupTimer::Clock::now();
+      profile_cache_ =
+          std::make_unique<ProfileCache>(options_.profile_directory);
+      if (!rom_.empty()) {
+        profile_cache_->Load(rom_, engine_, core_);
       }
+      startup_timer_.Record("load profile", begin);
+    }
+  }
 
-      // Add constant to register.
-      case (0x7000): {
-        variable_registers_[register1(instruction)] += constant8(instruction);
-        break;
-      }
+  // The number of instructions the engine has run, in any tier.
+  int64_t EngineInstructions() const {
+    int64_t total = 0;
+    for (auto instructions : engine_.stats().instructions) {
+      total += instructions;
+    }
+    return total;
+  }
 
-      // Two register arithmetic.
-      case (0x8000): {
-        auto& vx = variable_registers_[register1(instruction)];
-        auto& vy = variable_registers_[register2(instruction)];
-        auto flag = instruction & 0x000F;
-        if (flag == 0x0000) {
-          vx = vy;
-        } else if (flag == 0x0001) {
-          vx |= vy;
-        } else if (flag == 0x0002) {
-          vx &= vy;
-        } else if (flag == 0x0003) {
-          vx ^= vy;
-        } else if (flag == 0x0004) {
-          vx = add(vx, vy);
-        } else if (flag == 0x0005) {
-          vx = subtract(vx, vy);
-        } else if (flag == 0x0006) {
-          vx >>= 1;
-        } else if (flag == 0x0007) {
-          vx = subtract(vy, vx);
-        } else if (flag == 0x000E) {
-          vx <<= 1;
-        }
-        break;
+  // Bitmask of the Chip8 keys which are currently held down.
+  uint16_t PressedKeys() {
+    uint16_t keys = 0;
+    for (int key = 0; key < Chip8Core::kNumKeys; ++key) {
+      if (screen_.IsPressed(key_mapping_[key])) {
+        keys |= 1 << key;
       }
+    }
+    return keys;
+  }
 
-      // Jump not equal register.
-      case (0x9000): {
-        if (variable_registers_[register1(instruction)] !=
-            variable_registers_[register2(instruction)]) {
-          program_counter_ += 2;
-        }
-        break;
-      }
+  // Plays (and records) the sound for the frame that just ran. The audio
+  // device is only opened once the game first makes a sound, since opening
+  // it can take longer than the rest of starting up.
+  void PlayAudio() {
+    audio_synth_.Render(core_.state(), kMillisecondsPerFrame / 1000.0,
+                        audio_samples_);
+    if (!audio_output_ && core_.state().sound_timer > 0) {
+      audio_output_ = std::make_unique<AudioOutput>();
+    }
+    if (audio_output_) {
+      audio_output_->Push(audio_samples_);
+    }
+    if (wav_recorder_) {
+      wav_recorder_->Push(audio_samples_);
+    }
+  }
 
-      // Index register set.
-      case (0xA000): {
-        index_register_ = constant12(instruction);
-        break;
-      }
+  // Runs a frame of the game, which is on the interpreter while coverage is
+  // being recorded.
+  void RunGameFrame() {
+    if (coverage_) {
+      coverage_->RunFrame(core_);
+    } else {
+      engine_.RunFrame(core_);
+    }
+  }
 
-      // Jump by offset.
-      case (0xB000): {
-        program_counter_ = constant12(instruction) + variable_registers_[0];
-        break;
-      }
+  // Saves the engine's profile under the ROM as it is now, which after a
+  // reload with `watch_rom` is the latest version.
+  void SaveProfile() {
+    std::vector<unsigned char> rom;
+    if (profile_cache_ && Chip8Core::ReadRom(rom_file_path_, rom) &&
+        !profile_cache_->Save(rom, engine_)) {
+      std::cout << "Failed to save the profile for " << rom_file_path_
+                << " to " << options_.profile_directory << std::endl;
+    }
+  }
 
-      // Generate random.
-      case (0xC000): {
-        variable_registers_[register1(instruction)] =
-            (rand() % 255) & constant8(instruction);
-        break;
-      }
+  // Saves the game to `slot`, which is written to disk in the background.
+  void SaveSlot(int slot) {
+    save_slots_->Save(slot, core_.state());
+    std::cout << "Saved slot " << slot + 1 << std::endl;
+  }
 
-      // Draws the bitmap sprite pointed to by the index register to the
-      // screen.
-      case (0xD000): {
-        auto row_start = variable_registers_[register2(instruction)] % 32;
-        auto col_start = variable_registers_[register1(instruction)] % 64;
-        auto height = instruction & 0x000F;
-        variable_registers_[0xF] = 0;
-
-        for (int sprite_row_offset = 0; sprite_row_offset < height;
-             ++sprite_row_offset) {
-          auto row = row_start + sprite_row_offset;
-          if (row >= display_.size()) {
-            break;
-          }
+  void LoadSlot(int slot) {
+    if (!save_slots_->Load(slot, slot_state_)) {
+      std::cout << "Slot " << slot + 1 << " is empty" << std::endl;
+      return;
+    }
+    core_.LoadState(slot_state_);
+    StateReplaced();
+    std::cout << "Loaded slot " << slot + 1 << std::endl;
+  }
 
-          auto sprite_row = memory_[index_register_ + sprite_row_offset];
-          for (int sprite_col_offset = 0; sprite_col_offset < 8;
-               ++sprite_col_offset) {
-            auto col = col_start + sprite_col_offset;
-            if (col >= display_[row].size()) {
-              break;
-            }
-
-            // Check if the `sprite_col_offset`th bit from the left is set.
-            auto set = sprite_row & (1 << (7 - sprite_col_offset));
-            auto before = display_[row][col];
-            if (set) {
-              display_[row][col] ^= 1;
-              if (before) {
-                variable_registers_[0xF] = 1;
-              }
-            }
-          }
-        }
+  // The game jumped to a state it didn't run its way to, so recordings of it
+  // need a new keyframe.
+  void StateReplaced() {
+    if (time_travel_) {
+      time_travel_->Restart();
+    }
+    if (replay_recorder_) {
+      replay_recorder_->Cut();
+    }
+  }
 
-        break;
-      }
+  // Moves the replay being played to the start of `frame`.
+  void SeekReplay(int64_t frame) {
+    replay_frame_ = std::clamp<int64_t>(frame, 0, replay_->frames());
+    if (!replay_->Seek(replay_frame_, core_)) {
+      std::cout << "The replay is damaged at frame " << replay_frame_
+                << std::endl;
+    }
+  }
 
-      // Skip instructions based on key state.
-      case (0xE000): {
-        auto skip_state = (instruction & 0x00FF) == 0X009E;
-        auto key_code =
-            key_mapping_[variable_registers_[register1(instruction)]];
-        // Keep track of which keys the game has polled to give a hint of what
-        // the controls for the game are in the bottom bar.
-        keys_polled_.insert(SDL_GetScancodeName(key_code));
-        if (screen_.IsPressed(key_code) == skip_state) {
-          program_counter_ += 2;
-        }
-        break;
-      }
+  // "minutes:seconds" of a replay that is `frames` long.
+  static std::string ReplayTime(int64_t frames) {
+    auto seconds = frames * kMillisecondsPerFrame / 1000;
+    auto remainder = std::to_string(seconds % 60);
+    return std::to_string(seconds / 60) + ":" +
+           (remainder.size() == 1 ? "0" : "") + remainder;
+  }
 
-      // The F* instructions are a bit of grab bag...
-      case (0xF000): {
-        auto flag = instruction & 0x00FF;
-        if (flag == 0x0007) {
-          variable_registers_[register1(instruction)] = delay_timer_;
-        } else if (flag == 0x0015) {
-          delay_timer_ = variable_registers_[register1(instruction)];
-        } else if (flag == 0x0018) {
-          std::cout << "\a" << std::endl;
-        } else if (flag == 0x000A) {
-          if (!screen_.IsPressed(key_mapping_[0])) {
-            program_counter_ -= 2;
-          } else {
-            variable_registers_[register1(instruction)] = 0;
-          }
-        } else if (flag == 0x001E) {
-          index_register_ += variable_registers_[register1(instruction)];
-        } else if (flag == 0x0029) {
-          constexpr int kFontCharacterHeight = 5;
-          index_register_ =
-              font_address_ +
-              (variable_registers_[register1(instruction)] & 0x000F) *
-                  kFontCharacterHeight;
-        } else if (flag == 0x0033) {
-          auto vx = variable_registers_[register1(instruction)];
-          memory_[index_register_] = vx / 100;
-          vx %= 100;
-          memory_[index_register_ + 1] = vx / 10;
-          memory_[index_register_ + 2] = vx % 10;
-        } else if (flag == 0x0055) {
-          for (int i = 0; i <= register1(instruction); ++i) {
-            memory_[index_register_ + i] = variable_registers_[i];
-          }
-        } else if (flag == 0x0065) {
-          for (int i = 0; i <= register1(instruction); ++i) {
-            variable_registers_[i] = memory_[index_register_ + i];
-          }
-        }
-        break;
-      }
+  // Prints why the game stopped the first time that it faults, and any stack
+  // errors that `StackPolicy::kReport` let it carry on from.
+  void ReportFault() {
+    bool faulted = core_.state().fault != Chip8Fault::kNone;
+    if (faulted && !fault_reported_) {
+      std::cout << "Halted: " << DescribeFault(core_.state()) << std::endl;
+    }
+    fault_reported_ = faulted;
+    if (core_.stack_errors() != stack_errors_reported_) {
+      stack_errors_reported_ = core_.stack_errors();
+      std::cout << "The stack overflowed or underflowed ("
+                << stack_errors_reported_ << " times so far)" << std::endl;
+    }
+  }
 
-      default: {
-        std::cout << "Unknown instruction" << std::endl;
-      }
-      }
+  // Runs the game `run_ahead_frames` into the future with the current input
+  // held, draws that future display and then rewinds back to the present.
+  void DrawRunAheadDisplay() {
+    core_.SaveState(run_ahead_snapshot_);
+    for (int frame = 0; frame < options_.run_ahead_frames; ++frame) {
+      engine_.RunFrame(core_);
     }
+    DrawGameDisplay();
+    core_.LoadState(run_ahead_snapshot_);
   }
 
-private:
   // Draw the actual game video memory to the screen.
   void DrawGameDisplay() {
     // Determine the scaling factors required to fit the chip8 display
     // memory fully to the screen.
     auto scale =
-        std::min(screen_.width() / display_.front().size(),
+        std::min(screen_.width() / Chip8Core::kDisplayWidth,
                  // Leave some space at the bottom of the screen to
                  // draw some status info.
-                 (screen_.height() - kBottomBarHeight) / display_.size());
+                 (screen_.height() - kBottomBarHeight) /
+                     Chip8Core::kDisplayHeight);
 
     // Generate a vector of all the filled rectangles that need to be drawn.
     std::vector<SDL_Rect> rects_to_draw;
-    for (int row = 0; row < display_.size(); ++row) {
-      for (int col = 0; col < display_[row].size(); ++col) {
-        if (display_[row][col]) {
+    for (int row = 0; row < Chip8Core::kDisplayHeight; ++row) {
+      for (int col = 0; col < Chip8Core::kDisplayWidth; ++col) {
+        if (core_.pixel(row, col)) {
           SDL_Rect r;
           r.x = col * scale;
           r.y = row * scale;
@@ -418,6 +503,14 @@ private:
     SDL_Rect divider{.x = 0, .y = start_y, .w = screen_.width(), .h = 3};
     screen_.DrawRects({divider}, Color::White());
 
+    // Keep track of which keys the game has polled to give a hint of what the
+    // controls for the game are.
+    for (int key = 0; key < Chip8Core::kNumKeys; ++key) {
+      if ((core_.keys_polled() >> key) & 1) {
+        keys_polled_.insert(SDL_GetScancodeName(key_mapping_[key]));
+      }
+    }
+
     std::string keys = "Controls: ";
     for (auto key_it = keys_polled_.begin(); key_it != keys_polled_.end();
          ++key_it) {
@@ -429,28 +522,72 @@ private:
     auto controls_rect =
         screen_.DrawText(keys, 50, start_y + kPadding, Color::White());
     auto timer_rect =
-        screen_.DrawText("Timer: " + std::to_string(delay_timer_),
+        screen_.DrawText("Timer: " + std::to_string(core_.state().delay_timer),
                          controls_rect.x + controls_rect.w + kPadding * 2,
                          start_y + kPadding, Color::White());
-    if (paused_) {
+    if (replay_) {
+      timer_rect = screen_.DrawText(
+          "Replay " + ReplayTime(replay_frame_) + " / " +
+              ReplayTime(replay_->frames()),
+          timer_rect.x + timer_rect.w + kPadding * 2, start_y + kPadding,
+          Color::White());
+    }
+    if (core_.state().fault != Chip8Fault::kNone) {
+      screen_.DrawText("HALTED", timer_rect.x + timer_rect.w + kPadding * 2,
+                       start_y + kPadding, Color::Red());
+    } else if (netplay_ && netplay_->waiting_for_peer()) {
+      screen_.DrawText("WAITING FOR PEER",
+                       timer_rect.x + timer_rect.w + kPadding * 2,
+                       start_y + kPadding, Color::Red());
+    } else if (paused_) {
       screen_.DrawText("PAUSED", timer_rect.x + timer_rect.w + kPadding * 2,
                        start_y + kPadding, Color::Red());
     }
+
+    if (show_perf_hud_) {
+      screen_.DrawText(perf_hud_.text(), 50, start_y + kPadding * 4,
+                       Color::White());
+    }
   }
 
-  std::vector<unsigned char> memory_;
-  std::vector<uint16_t> stack_;
-  uint16_t program_counter_ = 0x200;
-  std::vector<unsigned char> variable_registers_;
-  int index_register_ = 0;
-  std::vector<std::vector<unsigned char>> display_;
+  // Declared first so that it starts timing before anything else is set up.
+  StartupTimer startup_timer_;
+  EmulatorOptions options_;
+  std::string rom_file_path_;
+  Chip8Core core_;
+  BlockEngine engine_;
+  Chip8State run_ahead_snapshot_;
+  std::unique_ptr<NetplayTransport> netplay_transport_;
+  std::unique_ptr<RollbackSession> netplay_;
+  std::unique_ptr<RomWatcher> rom_watcher_;
+  std::unique_ptr<ProfileCache> profile_cache_;
+  // The ROM as it was when the game started.
+  std::vector<unsigned char> rom_;
+  std::unique_ptr<SaveSlots> save_slots_;
+  Chip8State slot_state_;
+  std::unique_ptr<TimeTravel> time_travel_;
+  std::unique_ptr<DebugConsole> debug_console_;
+  std::unique_ptr<ReplayRecorder> replay_recorder_;
+  std::unique_ptr<ReplayFile> replay_;
+  int64_t replay_frame_ = 0;
+  std::unique_ptr<CoverageMap> coverage_;
+  // Declared after everything `LoadGame` uses and before `screen_`.
+  std::future<void> game_loaded_;
   Screen screen_;
   std::vector<SDL_Scancode> key_mapping_;
-  int delay_timer_ = 0;
-  ClockRegulator cpu_clock_regulator_;
-  ClockRegulator draw_screen_regulator_;
-  int font_address_ = 0x050;
+  ClockRegulator frame_regulator_;
+  PerfHud perf_hud_;
+  bool show_perf_hud_;
   std::set<std::string> keys_polled_;
+  AudioSynth audio_synth_;
+  std::vector<int16_t> audio_samples_;
+  // Declared after `screen_` so audio is shut down before the rest of SDL.
+  std::unique_ptr<AudioOutput> audio_output_;
+  std::unique_ptr<WavRecorder> wav_recorder_;
+  static constexpr int kMillisecondsPerFrame = 17;
   static constexpr int kBottomBarHeight = 100;
   bool paused_ = false;
+  bool fault_reported_ = false;
+  int64_t stack_errors_reported_ = 0;
+  bool first_frame_shown_ = false;
 };
@@ -1,37 +1,139 @@
-#include <chrono>
-#include <iostream>
-#include <thread>
+#ifndef CLOCK_REGULATOR_H
+#define CLOCK_REGULATOR_H
 
-// A class which helps regulate CPU/frame clocks. The `Tick` method will return
-// true once every `milliseconds_per_cycle` milliseconds. `Tick` should be
-// called first/early in your main program loop. E.g.
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+
+// A class which helps regulate CPU/frame clocks. `Wait` sleeps until the next
+// tick, which is due every `milliseconds_per_cycle` milliseconds, so it should
+// be called at the top of your main program loop. E.g.
 //
 // void MainLoop() {
 //   while (true) {
-//     if (!regulator.Tick()) {
-//        // continue or do non-clock synced work.
-//     }
+//     regulator.Wait();
+//     // clock synced work.
 //   }
 // }
+//
+// Ticks are due at fixed times rather than a period after the last one
+// happened to wake up, so lateness doesn't build up. They are timed with
+// `CLOCK_MONOTONIC`, which unlike the wall clock never jumps, and slept for
+// with `clock_nanosleep` until the absolute deadline, which can't oversleep by
+// the time spent working out how long to sleep for.
+//
+// How late every tick woke up is recorded in a histogram, to show how steady
+// the timing is on a busy machine; see `stats` and `DumpStats`.
 class ClockRegulator {
 public:
-  using Clock = std::chrono::high_resolution_clock;
+  // Lateness is bucketed by powers of two microseconds: bucket 0 is under
+  // 1us, bucket `i` is [2^(i-1)us, 2^i us) and the last bucket is everything
+  // from about half a second up.
+  static constexpr int kNumBuckets = 21;
+
+  struct Stats {
+    int64_t ticks = 0;
+    // Ticks which were skipped because the loop fell a whole period or more
+    // behind, rather than being run back to back to catch up.
+    int64_t missed_ticks = 0;
+    int64_t total_lateness_ns = 0;
+    int64_t max_lateness_ns = 0;
+    std::array<int64_t, kNumBuckets> lateness_histogram{};
+  };
 
   ClockRegulator(int milliseconds_per_cycle)
-      : milliseconds_per_cycle_(milliseconds_per_cycle),
-        ready_at_(Clock::now()) {}
-
-  bool Tick() {
-    auto now = Clock::now();
-    // If enough time has elapsed since the previous tick, update the next tick
-    // to happen in `milliseconds_per_cycle_` milliseconds.
-    if (now >= ready_at_) {
-      ready_at_ = now + std::chrono::milliseconds(milliseconds_per_cycle_);
-      return true;
+      : period_ns_(int64_t(milliseconds_per_cycle) * 1000000),
+        ready_at_(Now()) {}
+
+  // Sleeps until the next tick is due.
+  void Wait() {
+    timespec deadline{.tv_sec = time_t(ready_at_ / 1000000000),
+                      .tv_nsec = long(ready_at_ % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                           nullptr) == EINTR) {
+    }
+    auto lateness = Now() - ready_at_;
+    Record(lateness);
+    ready_at_ += period_ns_;
+    if (lateness >= period_ns_) {
+      stats_.missed_ticks += lateness / period_ns_;
+      ready_at_ += lateness / period_ns_ * period_ns_;
+    }
+  }
+
+  const Stats& stats() const { return stats_; }
+
+  // The tick lateness below which `percentile` percent of ticks woke up, to
+  // the resolution of the histogram (i.e. the top of the bucket it's in, or
+  // the latest tick if that's sooner).
+  int64_t PercentileNs(double percentile) const {
+    int64_t below = 0;
+    for (int bucket = 0; bucket < kNumBuckets; ++bucket) {
+      below += stats_.lateness_histogram[bucket];
+      if (below * 100.0 >= percentile * stats_.ticks) {
+        return std::min(BucketEndNs(bucket), stats_.max_lateness_ns);
+      }
     }
-    return false;
+    return stats_.max_lateness_ns;
   }
 
-  int milliseconds_per_cycle_;
-  std::chrono::time_point<std::chrono::high_resolution_clock> ready_at_;
+  // Prints the lateness of the ticks so far, with a histogram.
+  void DumpStats(std::ostream& out) const {
+    if (stats_.ticks == 0) {
+      return;
+    }
+    out << "Clock: " << stats_.ticks << " ticks of " << period_ns_ / 1000000
+        << "ms, " << stats_.missed_ticks << " missed\n"
+        << "  lateness mean " << stats_.total_lateness_ns / stats_.ticks / 1000
+        << "us, p50 <= " << PercentileNs(50) / 1000 << "us, p99 <= "
+        << PercentileNs(99) / 1000 << "us, p99.9 <= "
+        << PercentileNs(99.9) / 1000 << "us, max "
+        << stats_.max_lateness_ns / 1000 << "us\n";
+    for (int bucket = 0; bucket < kNumBuckets; ++bucket) {
+      auto count = stats_.lateness_histogram[bucket];
+      if (count == 0) {
+        continue;
+      }
+      out << "  < " << std::setw(7)
+          << (bucket + 1 < kNumBuckets
+                  ? std::to_string(BucketEndNs(bucket) / 1000) + "us"
+                  : std::string("max"))
+          << std::setw(10) << count << " "
+          << std::string(50 * count / stats_.ticks, '#') << "\n";
+    }
+  }
+
+private:
+  static int64_t Now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+  }
+
+  static int64_t BucketEndNs(int bucket) { return int64_t(1000) << bucket; }
+
+  void Record(int64_t lateness_ns) {
+    lateness_ns = std::max<int64_t>(0, lateness_ns);
+    int bucket = 0;
+    while (bucket + 1 < kNumBuckets && lateness_ns >= BucketEndNs(bucket)) {
+      ++bucket;
+    }
+    ++stats_.ticks;
+    stats_.total_lateness_ns += lateness_ns;
+    stats_.max_lateness_ns = std::max(stats_.max_lateness_ns, lateness_ns);
+    ++stats_.lateness_histogram[bucket];
+  }
+
+  int64_t period_ns_;
+  // When the next tick is due, in `CLOCK_MONOTONIC` nanoseconds.
+  int64_t ready_at_;
+  Stats stats_;
 };
+
+#endif /* CLOCK_REGULATOR_H */
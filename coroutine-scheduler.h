@@ -0,0 +1,364 @@
+#ifndef COROUTINE_SCHEDULER_H
+#define COROUTINE_SCHEDULER_H
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chip8-core.h"
+
+// A coroutine which is resumed by `CoroutineScheduler`. It starts suspended
+// and is destroyed along with the task.
+class Chip8Task {
+public:
+  struct promise_type {
+    Chip8Task get_return_object() {
+      return Chip8Task(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  explicit Chip8Task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+  Chip8Task(Chip8Task&& other) : handle_(std::exchange(other.handle_, {})) {}
+  Chip8Task(const Chip8Task&) = delete;
+  Chip8Task& operator=(const Chip8Task&) = delete;
+  ~Chip8Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  void Resume() { handle_.resume(); }
+  bool done() const { return handle_.done(); }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Multiplexes many emulator sessions over a small pool of threads. Each
+// session's run loop is a coroutine which runs one frame every time it is
+// resumed and then yields back to its thread, so thousands of sessions can
+// share a thread with no more switching overhead than a function call.
+//
+// A session whose game is waiting for a key (FX0A) yields until its input
+// changes instead of being resumed every frame for nothing. Its timers are
+// caught up when it wakes so that the game can't tell it was asleep. A session
+// which is only late, because its thread fell behind, isn't caught up: it runs
+// fewer frames and its timers slow down along with them.
+//
+// Sessions are assigned to threads round robin and stay on the same thread for
+// their whole life.
+//
+// The CPU time each session uses is accounted for without reading the thread's
+// CPU clock around every frame, which costs more than a frame does. Instead
+// each frame is timed with the much cheaper monotonic clock, and once per pass
+// over its sessions a worker scales those times by the share of the pass it
+// actually had the CPU for.
+class CoroutineScheduler {
+public:
+  // Called on the session's thread after each frame it runs.
+  using FrameFn = std::function<void(int session, const Chip8Core& core)>;
+
+  struct SessionStats {
+    int64_t frames = 0;
+    std::chrono::nanoseconds cpu_time{0};
+  };
+
+  explicit CoroutineScheduler(int num_threads) {
+    for (int i = 0; i < std::max(1, num_threads); ++i) {
+      workers_.push_back(std::make_unique<Worker>());
+    }
+    for (auto& worker : workers_) {
+      worker->thread = std::thread([this, &worker = *worker]() {
+        RunWorker(worker);
+      });
+    }
+  }
+
+  ~CoroutineScheduler() {
+    for (auto& worker : workers_) {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->stop = true;
+    }
+    for (auto& worker : workers_) {
+      worker->wake.notify_one();
+      worker->thread.join();
+    }
+  }
+
+  // Starts a new session running `rom`, with random numbers drawn from `seed`,
+  // and returns its id. With `real_time` the session runs at 60 frames per
+  // second, otherwise as fast as its thread can manage alongside the thread's
+  // other sessions.
+  int AddSession(const std::vector<unsigned char>& rom, uint64_t seed,
+                 FrameFn on_frame = nullptr, bool real_time = true) {
+    int id = next_session_id_++;
+    auto session = std::make_unique<Session>();
+    session->id = id;
+    session->real_time = real_time;
+    session->core.Seed(seed);
+    session->core.LoadRom(rom);
+    session->on_frame = std::move(on_frame);
+    session->task = std::make_unique<Chip8Task>(RunSession(*session));
+
+    auto& worker = WorkerFor(id);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.ready.push_back(session.get());
+    worker.sessions[id] = std::move(session);
+    worker.wake.notify_one();
+    return id;
+  }
+
+  // Sets the keys that the session's game sees from its next frame on.
+  void SetKeys(int id, uint16_t keys) {
+    auto& worker = WorkerFor(id);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto it = worker.sessions.find(id);
+    if (it == worker.sessions.end() || it->second->keys == keys) {
+      return;
+    }
+    auto& session = *it->second;
+    session.keys = keys;
+    if (session.parked) {
+      session.parked = false;
+      session.unparked = true;
+      worker.ready.push_back(&session);
+      worker.wake.notify_one();
+    }
+  }
+
+  // Ends the session. This doesn't wait for the session's worker, which may
+  // be in the middle of one of its frames, so the frame callback can still be
+  // called once after this returns.
+  void RemoveSession(int id) {
+    auto& worker = WorkerFor(id);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto it = worker.sessions.find(id);
+    if (it == worker.sessions.end()) {
+      return;
+    }
+    // A parked session isn't referenced by the worker, otherwise the worker
+    // deletes the session the next time it comes up.
+    if (it->second->parked) {
+      worker.sessions.erase(it);
+      return;
+    }
+    it->second->removed = true;
+  }
+
+  // Total frames run by all sessions so far.
+  int64_t frames() const {
+    int64_t frames = 0;
+    for (auto& worker : workers_) {
+      frames += worker->frames.load(std::memory_order_relaxed);
+    }
+    return frames;
+  }
+
+  // The frames run and CPU time used by the session so far. Returns false if
+  // there is no such session.
+  bool GetStats(int id, SessionStats& stats) {
+    auto& worker = WorkerFor(id);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto it = worker.sessions.find(id);
+    if (it == worker.sessions.end()) {
+      return false;
+    }
+    stats = it->second->stats;
+    return true;
+  }
+
+private:
+  struct Session {
+    int id;
+    bool real_time = true;
+    Chip8Core core;
+    FrameFn on_frame;
+    std::unique_ptr<Chip8Task> task;
+    // Set by the run loop while it is suspended waiting for input.
+    bool waiting_for_input = false;
+    // The scheduler tick at which the session last ran, or -1 before its first
+    // frame.
+    int64_t last_tick = -1;
+    // Guarded by the worker's mutex: the latest keys, the keys that the last
+    // frame ran with, whether the session is asleep until they differ and
+    // whether it has just been woken.
+    uint16_t keys = 0;
+    uint16_t frame_keys = 0;
+    bool parked = false;
+    bool unparked = false;
+    bool removed = false;
+    SessionStats stats;
+    // Monotonic clock time spent running the session's frames in the current
+    // pass, before it is scaled into CPU time.
+    int64_t pass_ns = 0;
+  };
+
+  struct Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::unordered_map<int, std::unique_ptr<Session>> sessions;
+    // Sessions to resume on the next tick.
+    std::vector<Session*> ready;
+    bool stop = false;
+    // Frames run by the worker's sessions. Only the worker writes it, and it
+    // has a cache line of its own so that workers don't contend for it.
+    alignas(64) std::atomic<int64_t> frames = 0;
+  };
+
+  // Awaited by a run loop at the end of every frame. When `session` is given,
+  // the session has nothing to do until its input changes.
+  struct Yield {
+    Session* session = nullptr;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {
+      if (session) {
+        session->waiting_for_input = true;
+      }
+    }
+    void await_resume() const noexcept {
+      if (session) {
+        session->waiting_for_input = false;
+      }
+    }
+  };
+
+  // A session's run loop: one frame per resumption.
+  Chip8Task RunSession(Session& session) {
+    while (true) {
+      session.core.RunFrame();
+      if (session.on_frame) {
+        session.on_frame(session.id, session.core);
+      }
+
+      if (session.core.waiting_for_key()) {
+        co_await Yield{.session = &session};
+      } else {
+        co_await Yield{};
+      }
+    }
+  }
+
+  Worker& WorkerFor(int id) { return *workers_[id % workers_.size()]; }
+
+  void RunWorker(Worker& worker) {
+    constexpr auto kFrameTime = std::chrono::microseconds(16667);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Session*> running;
+    std::vector<Session*> ran;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.wake.wait(
+            lock, [&]() { return worker.stop || !worker.ready.empty(); });
+        if (worker.stop) {
+          return;
+        }
+        running.swap(worker.ready);
+      }
+      // A tick is a 60hz frame of wall clock time, and real time sessions run
+      // once per tick. A worker that falls behind runs fewer frames rather
+      // than bursting to catch up.
+      int64_t tick = (std::chrono::steady_clock::now() - start) / kFrameTime;
+      auto pass_cpu_start = ClockNs(CLOCK_THREAD_CPUTIME_ID);
+      auto pass_start = ClockNs(CLOCK_MONOTONIC);
+      bool any_fast = false;
+
+      for (auto* session : running) {
+        bool woken;
+        {
+          std::lock_guard<std::mutex> lock(worker.mutex);
+          if (session->removed) {
+            worker.sessions.erase(session->id);
+            continue;
+          }
+          if (session->real_time && session->last_tick == tick) {
+            worker.ready.push_back(session);
+            continue;
+          }
+          session->frame_keys = session->keys;
+          woken = std::exchange(session->unparked, false);
+        }
+
+        // Catch up on the timer ticks missed while parked waiting for input.
+        // Sessions which aren't real time have no time to catch up with.
+        if (woken && session->real_time && session->last_tick >= 0) {
+          for (int64_t missed = std::min<int64_t>(
+                   tick - session->last_tick - 1, /* timer maximum = */ 255);
+               missed > 0; --missed) {
+            session->core.TickTimers();
+          }
+        }
+        session->last_tick = tick;
+        session->core.SetKeys(session->frame_keys);
+        auto frame_start = ClockNs(CLOCK_MONOTONIC);
+        session->task->Resume();
+        session->pass_ns += ClockNs(CLOCK_MONOTONIC) - frame_start;
+        ran.push_back(session);
+      }
+      running.clear();
+      worker.frames.fetch_add(ran.size(), std::memory_order_relaxed);
+
+      // Share out the CPU time the pass used in proportion to the time each
+      // session ran for. Sessions are only parked afterwards, since a parked
+      // session can be deleted by `RemoveSession` at any time.
+      double cpu_share =
+          double(ClockNs(CLOCK_THREAD_CPUTIME_ID) - pass_cpu_start) /
+          std::max<int64_t>(1, ClockNs(CLOCK_MONOTONIC) - pass_start);
+      {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        for (auto* session : ran) {
+          ++session->stats.frames;
+          session->stats.cpu_time += std::chrono::nanoseconds(
+              int64_t(session->pass_ns * std::min(1.0, cpu_share)));
+          session->pass_ns = 0;
+          if (session->waiting_for_input &&
+              session->keys == session->frame_keys && !session->removed) {
+            session->parked = true;
+          } else {
+            worker.ready.push_back(session);
+            any_fast |= !session->real_time;
+          }
+        }
+      }
+      ran.clear();
+
+      // With only real time sessions left there's nothing to do until the
+      // next tick.
+      if (!any_fast) {
+        std::this_thread::sleep_until(start + (tick + 1) * kFrameTime);
+      }
+    }
+  }
+
+  static int64_t ClockNs(clockid_t clock) {
+    timespec now;
+    clock_gettime(clock, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<int> next_session_id_ = 0;
+};
+
+#endif /* COROUTINE_SCHEDULER_H */
@@ -0,0 +1,25 @@
+#ifndef COUNTER_RANDOM_H
+#define COUNTER_RANDOM_H
+
+#include <cstdint>
+
+// A counter based random number generator: the n'th number of a stream is a
+// pure function of the stream's seed and n, so a generator's whole state is
+// two integers that can be copied around with the rest of the emulator state.
+// Streams with different seeds are independent of each other.
+//
+// The mixing function is the finalizer of SplitMix64, applied once to the seed
+// and once more to the seed combined with the counter.
+inline uint64_t CounterRandomMix(uint64_t z) {
+  z += 0x9E3779B97F4A7C15;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+inline uint64_t CounterRandom(uint64_t seed, uint64_t counter) {
+  return CounterRandomMix(CounterRandomMix(seed) +
+                          counter * 0x9E3779B97F4A7C15);
+}
+
+#endif /* COUNTER_RANDOM_H */
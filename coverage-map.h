@@ -0,0 +1,218 @@
+#ifndef COVERAGE_MAP_H
+#define COVERAGE_MAP_H
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "chip8-core.h"
+#include "disassembler.h"
+
+// Which parts of a program a run of it reached, for measuring how much of a
+// game automated play explores. Three bitmaps with one bit per address of
+// memory record:
+//   - the addresses an instruction was run from,
+//   - the skips (3XNN, 4XNN, 5XY0, 9XY0, EX9E and EXA1) which skipped,
+//   - and the skips which didn't.
+//
+// Recording needs the address of every instruction that runs, so a covered
+// game runs one instruction at a time on the interpreter rather than on the
+// block engine.
+class CoverageMap {
+public:
+  // Runs one frame of `core`, recording what it reached.
+  void RunFrame(Chip8Core& core) {
+    for (int i = 0; i < Chip8Core::kInstructionsPerFrame; ++i) {
+      Step(core);
+    }
+    core.TickTimers();
+  }
+
+  // Runs one instruction of `core`, recording what it reached.
+  void Step(Chip8Core& core) {
+    auto& state = core.state();
+    int pc = state.program_counter;
+    auto instruction = Read(state.memory, pc);
+    core.Step();
+    if (state.fault != Chip8Fault::kNone) {
+      return;
+    }
+    executed_[pc] = true;
+    if (IsSkip(instruction)) {
+      (state.program_counter == pc + 4 ? taken_ : not_taken_)[pc] = true;
+    }
+  }
+
+  // Writes a summary of how much of `rom` was reached followed by a listing of
+  // its code, disassembled and marked with what ran.
+  //
+  // Which bytes of a ROM are code isn't recorded anywhere, so it is worked out
+  // by following every path through the program from its start, plus every
+  // instruction that was actually run (which finds code reached through BNNN
+  // jumps, whose targets are only known at run time). Everything else is
+  // listed as data.
+  void WriteReport(std::ostream& out,
+                   const std::vector<unsigned char>& rom) const {
+    auto code = FindCode(rom);
+    int instructions = 0, instructions_run = 0;
+    int skips = 0, skips_both = 0, skips_one = 0;
+    for (int address = 0; address < kMemorySize; ++address) {
+      if (!code[address]) {
+        continue;
+      }
+      ++instructions;
+      instructions_run += executed_[address];
+      if (IsSkip(Read(rom, address))) {
+        ++skips;
+        int ways = taken_[address] + not_taken_[address];
+        skips_both += ways == 2;
+        skips_one += ways == 1;
+      }
+    }
+    int outside = 0;
+    for (int address = 0; address < kMemorySize; ++address) {
+      outside += executed_[address] && !InRom(rom, address);
+    }
+
+    auto percent = [](int part, int whole) {
+      return whole == 0 ? 0.0 : 100.0 * part / whole;
+    };
+    out << std::fixed << std::setprecision(1) << "Instructions reached: "
+        << instructions_run << " of " << instructions << " ("
+        << percent(instructions_run, instructions) << "%)\n"
+        << "Skips taken both ways: " << skips_both << " of " << skips << " ("
+        << percent(skips_both, skips) << "%), one way: " << skips_one
+        << "\n";
+    if (outside > 0) {
+      out << "Instructions run from outside the ROM: " << outside << "\n";
+    }
+    out << "\n";
+
+    out << std::hex << std::setfill('0');
+    for (int address = kProgramAddress; InRom(rom, address);) {
+      if (!code[address]) {
+        int start = address;
+        while (InRom(rom, address) && !code[address]) {
+          ++address;
+        }
+        out << "  " << std::setw(3) << start << "  " << std::dec
+            << address - start << " bytes of data\n"
+            << std::hex;
+        continue;
+      }
+      auto instruction = Read(rom, address);
+      auto text = Disassemble(instruction);
+      out << (executed_[address] ? "* " : "  ") << std::setw(3) << address
+          << "  " << std::setw(4) << instruction << "  " << text;
+      if (IsSkip(instruction)) {
+        out << std::string(std::max<int>(1, 16 - text.size()), ' ')
+            << (taken_[address] ? "taken" : "never taken") << ", "
+            << (not_taken_[address] ? "not taken" : "never not taken");
+      }
+      out << "\n";
+      address += 2;
+    }
+    out << std::dec << std::setfill(' ');
+  }
+
+  // The same, written to the file at `path`. Returns false if it couldn't be
+  // written.
+  bool WriteReport(const std::string& path,
+                   const std::vector<unsigned char>& rom) const {
+    std::ofstream file(path);
+    WriteReport(file, rom);
+    return bool(file.flush());
+  }
+
+private:
+  static constexpr int kMemorySize = sizeof(Chip8State::memory);
+  static constexpr int kProgramAddress = 0x200;
+
+  static bool IsSkip(uint16_t instruction) {
+    switch (instruction >> 12) {
+    case 0x3:
+    case 0x4:
+      return true;
+    case 0x5:
+    case 0x9:
+      return (instruction & 0xF) == 0;
+    case 0xE:
+      return (instruction & 0xFF) == 0x9E || (instruction & 0xFF) == 0xA1;
+    }
+    return false;
+  }
+
+  template <typename Memory>
+  static uint16_t Read(const Memory& memory, int address) {
+    return (memory[address % kMemorySize] << 8) |
+           memory[(address + 1) % kMemorySize];
+  }
+
+  // Reads the instruction at `address` of memory with `rom` loaded.
+  static uint16_t Read(const std::vector<unsigned char>& rom, int address) {
+    auto byte = [&](int address) {
+      return InRom(rom, address) ? rom[address - kProgramAddress] : 0;
+    };
+    return (byte(address) << 8) | byte(address + 1);
+  }
+
+  static bool InRom(const std::vector<unsigned char>& rom, int address) {
+    return address >= kProgramAddress &&
+           address < kProgramAddress + int(rom.size());
+  }
+
+  // The addresses of the instructions in `rom` that can be reached from its
+  // start or from an instruction that ran.
+  std::bitset<kMemorySize> FindCode(
+      const std::vector<unsigned char>& rom) const {
+    std::bitset<kMemorySize> code;
+    std::vector<int> pending = {kProgramAddress};
+    for (int address = 0; address < kMemorySize; ++address) {
+      if (executed_[address]) {
+        pending.push_back(address);
+      }
+    }
+    while (!pending.empty()) {
+      int address = pending.back();
+      pending.pop_back();
+      if (!InRom(rom, address) || !InRom(rom, address + 1) || code[address]) {
+        continue;
+      }
+      auto instruction = Read(rom, address);
+      if (!executed_[address] &&
+          Disassemble(instruction).compare(0, 3, "DW ") == 0) {
+        continue;
+      }
+      code[address] = true;
+      switch (instruction >> 12) {
+      case 0x1:
+        pending.push_back(instruction & 0xFFF);
+        continue;
+      case 0x2:
+        pending.push_back(instruction & 0xFFF);
+        break;
+      case 0xB:
+        continue;
+      }
+      if (instruction == 0x00EE) {
+        continue;
+      }
+      if (IsSkip(instruction)) {
+        pending.push_back(address + 4);
+      }
+      pending.push_back(address + 2);
+    }
+    return code;
+  }
+
+  std::bitset<kMemorySize> executed_;
+  std::bitset<kMemorySize> taken_;
+  std::bitset<kMemorySize> not_taken_;
+};
+
+#endif /* COVERAGE_MAP_H */
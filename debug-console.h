@@ -0,0 +1,177 @@
+#ifndef DEBUG_CONSOLE_H
+#define DEBUG_CONSOLE_H
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "block-engine.h"
+#include "chip8-core.h"
+#include "disassembler.h"
+#include "time-travel.h"
+
+// A debugger for the running game, driven by commands typed on stdin while the
+// window is open. Alongside breakpoints and stepping forwards it can run the
+// game backwards, using a `TimeTravel` recording of the whole session:
+//
+//   step [n]          run n instructions (default 1)
+//   back [n]          undo n instructions (default 1)
+//   continue          carry on playing until a breakpoint
+//   reverse           run backwards to the last breakpoint
+//   lastwrite <addr>  run backwards to the last store to memory at addr
+//   break <addr>      add a breakpoint
+//   delete <addr>     remove a breakpoint
+//   state             print the registers
+//
+// Addresses are in hex. Any command other than `continue` pauses the game.
+class DebugConsole {
+public:
+  DebugConsole(Chip8Core& core, TimeTravel& time_travel)
+      : core_(core), time_travel_(time_travel) {
+    std::cout << "Debugger ready; type help for commands." << std::endl;
+  }
+
+  // Runs the commands which have been typed since the last call, without
+  // waiting for more. `keys` are the keys held now, for any new frames that
+  // stepping runs; `paused` is updated if a command pauses or resumes the game.
+  void Poll(uint16_t keys, bool& paused) {
+    while (open_) {
+      pollfd stdin_poll{.fd = STDIN_FILENO, .events = POLLIN};
+      if (::poll(&stdin_poll, 1, /* timeout = */ 0) <= 0) {
+        return;
+      }
+      char buffer[256];
+      auto length = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+      if (length <= 0) {
+        open_ = false;
+        return;
+      }
+      input_.append(buffer, length);
+      for (auto end = input_.find('\n'); end != std::string::npos;
+           end = input_.find('\n')) {
+        Run(input_.substr(0, end), keys, paused);
+        input_.erase(0, end + 1);
+      }
+    }
+  }
+
+  // Plays a frame with `keys`, recording it. With no breakpoints this is a
+  // frame on `engine` at full speed; otherwise instructions are run one at a
+  // time so that the game can pause as soon as it reaches a breakpoint, in
+  // which case `paused` is set.
+  void RunFrame(uint16_t keys, BlockEngine& engine, bool& paused) {
+    // Playing on from a point the game was rewound to takes a new path.
+    time_travel_.Truncate();
+    auto position = time_travel_.position();
+    if (breakpoints_.empty() &&
+        position % Chip8Core::kInstructionsPerFrame == 0) {
+      time_travel_.RecordFrame(keys);
+      core_.SetKeys(keys);
+      engine.RunFrame(core_);
+      return;
+    }
+    do {
+      // The instruction the game was paused on doesn't stop it again.
+      if (time_travel_.position() != position &&
+          breakpoints_.count(core_.state().program_counter)) {
+        std::cout << "Breakpoint" << std::endl;
+        PrintState();
+        paused = true;
+        return;
+      }
+      time_travel_.Step(keys);
+    } while (time_travel_.position() % Chip8Core::kInstructionsPerFrame != 0);
+  }
+
+private:
+  void Run(const std::string& line, uint16_t keys, bool& paused) {
+    std::istringstream words(line);
+    std::string command;
+    if (!(words >> command)) {
+      return;
+    }
+    int64_t count = 1;
+    unsigned address = 0;
+    if (command == "continue" || command == "c") {
+      paused = false;
+      return;
+    }
+    paused = true;
+    if (command == "step" || command == "s") {
+      words >> count;
+      for (int64_t i = 0; i < count; ++i) {
+        time_travel_.Step(keys);
+      }
+      PrintState();
+    } else if (command == "back" || command == "b") {
+      words >> count;
+      if (!time_travel_.StepBack(count)) {
+        std::cout << "At the start of the recording" << std::endl;
+      }
+      PrintState();
+    } else if (command == "reverse" || command == "r") {
+      if (!time_travel_.ReverseContinue(breakpoints_)) {
+        std::cout << "No earlier breakpoint" << std::endl;
+      }
+      PrintState();
+    } else if (command == "lastwrite" && words >> std::hex >> address) {
+      if (!time_travel_.RunBackToWrite(address)) {
+        std::cout << "No earlier store to 0x" << std::hex << address
+                  << std::dec << std::endl;
+      }
+      PrintState();
+    } else if (command == "break" && words >> std::hex >> address) {
+      breakpoints_.insert(address);
+    } else if (command == "delete" && words >> std::hex >> address) {
+      breakpoints_.erase(address);
+    } else if (command == "state") {
+      PrintState();
+    } else {
+      std::cout << "Commands: step [n], back [n], continue, reverse, "
+                   "lastwrite <addr>, break <addr>, delete <addr>, state"
+                << std::endl;
+    }
+  }
+
+  void PrintState() {
+    auto& state = core_.state();
+    auto position = time_travel_.position();
+    auto pc = state.program_counter;
+    uint16_t instruction =
+        (state.memory[pc] << 8) | state.memory[(pc + 1) % 4096];
+    std::cout << "frame " << position / Chip8Core::kInstructionsPerFrame
+              << " instruction " << position % Chip8Core::kInstructionsPerFrame
+              << std::hex << std::setfill('0') << "\n  pc " << std::setw(3)
+              << pc << ": " << std::setw(4) << instruction << " "
+              << Disassemble(instruction) << "\n  I "
+              << std::setw(3) << state.index_register << "  DT "
+              << std::setw(2) << int(state.delay_timer) << "  ST "
+              << std::setw(2) << int(state.sound_timer) << "\n ";
+    for (int r = 0; r < 16; ++r) {
+      std::cout << (r == 8 ? "\n  " : " ") << "V" << std::uppercase << r
+                << std::nouppercase << " " << std::setw(2)
+                << int(state.variable_registers[r]);
+    }
+    std::cout << "\n  stack";
+    for (int i = 0; i < state.stack_depth; ++i) {
+      std::cout << " " << std::setw(3) << state.stack[i];
+    }
+    std::cout << std::dec << std::setfill(' ') << std::endl;
+  }
+
+  Chip8Core& core_;
+  TimeTravel& time_travel_;
+  std::set<uint16_t> breakpoints_;
+  // Typed input which doesn't make up a whole line yet.
+  std::string input_;
+  // False once stdin is closed.
+  bool open_ = true;
+};
+
+#endif /* DEBUG_CONSOLE_H */
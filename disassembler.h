@@ -0,0 +1,102 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// The assembly for `instruction`, in the style of Cowgod's Chip-8 technical
+// reference (e.g. "LD V1, 0x05" for 6105) plus XO-CHIP's audio instructions.
+// Instructions which `Chip8Core` can't run are shown as data ("DW 0x0123").
+inline std::string Disassemble(uint16_t instruction) {
+  int x = (instruction >> 8) & 0xF;
+  int y = (instruction >> 4) & 0xF;
+  int n = instruction & 0xF;
+  int nn = instruction & 0xFF;
+  int nnn = instruction & 0xFFF;
+  char text[32];
+  auto format = [&](const char* pattern, auto... args) {
+    std::snprintf(text, sizeof(text), pattern, args...);
+    return std::string(text);
+  };
+
+  switch (instruction >> 12) {
+  case 0x0:
+    if (instruction == 0x00E0) {
+      return "CLS";
+    } else if (instruction == 0x00EE) {
+      return "RET";
+    }
+    break;
+  case 0x1:
+    return format("JP 0x%03X", nnn);
+  case 0x2:
+    return format("CALL 0x%03X", nnn);
+  case 0x3:
+    return format("SE V%X, 0x%02X", x, nn);
+  case 0x4:
+    return format("SNE V%X, 0x%02X", x, nn);
+  case 0x5:
+    return format("SE V%X, V%X", x, y);
+  case 0x6:
+    return format("LD V%X, 0x%02X", x, nn);
+  case 0x7:
+    return format("ADD V%X, 0x%02X", x, nn);
+  case 0x8: {
+    static const char* const kOperations[16] = {
+        "LD",   "OR",    "AND",   "XOR",   "ADD",   "SUB",   "SHR",
+        "SUBN", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+        "SHL",  nullptr};
+    if (kOperations[n]) {
+      return format("%s V%X, V%X", kOperations[n], x, y);
+    }
+    break;
+  }
+  case 0x9:
+    return format("SNE V%X, V%X", x, y);
+  case 0xA:
+    return format("LD I, 0x%03X", nnn);
+  case 0xB:
+    return format("JP V0, 0x%03X", nnn);
+  case 0xC:
+    return format("RND V%X, 0x%02X", x, nn);
+  case 0xD:
+    return format("DRW V%X, V%X, %d", x, y, n);
+  case 0xE:
+    if (nn == 0x9E) {
+      return format("SKP V%X", x);
+    } else if (nn == 0xA1) {
+      return format("SKNP V%X", x);
+    }
+    break;
+  case 0xF:
+    switch (nn) {
+    case 0x02:
+      return "AUDIO";
+    case 0x07:
+      return format("LD V%X, DT", x);
+    case 0x0A:
+      return format("LD V%X, K", x);
+    case 0x15:
+      return format("LD DT, V%X", x);
+    case 0x18:
+      return format("LD ST, V%X", x);
+    case 0x1E:
+      return format("ADD I, V%X", x);
+    case 0x29:
+      return format("LD F, V%X", x);
+    case 0x33:
+      return format("LD B, V%X", x);
+    case 0x3A:
+      return format("PITCH V%X", x);
+    case 0x55:
+      return format("LD [I], V%X", x);
+    case 0x65:
+      return format("LD V%X, [I]", x);
+    }
+    break;
+  }
+  return format("DW 0x%04X", instruction);
+}
+
+#endif /* DISASSEMBLER_H */
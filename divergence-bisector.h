@@ -0,0 +1,168 @@
+#ifndef DIVERGENCE_BISECTOR_H
+#define DIVERGENCE_BISECTOR_H
+
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "block-engine.h"
+#include "chip8-core.h"
+#include "disassembler.h"
+#include "replay-file.h"
+#include "state-file.h"
+
+// Prints the parts of `a` and `b` which differ, labelled `a_name` and
+// `b_name`.
+inline void PrintStateDiff(std::ostream& out, const Chip8State& a,
+                           const Chip8State& b, const char* a_name,
+                           const char* b_name) {
+  auto row = [&](const std::string& what, int a_value, int b_value,
+                 int width) {
+    out << "  " << std::setw(10) << std::left << what << std::right
+        << std::hex << std::setfill('0') << a_name << " " << std::setw(width)
+        << a_value << ", " << b_name << " " << std::setw(width) << b_value
+        << std::dec << std::setfill(' ') << "\n";
+  };
+  if (a.program_counter != b.program_counter) {
+    row("PC", a.program_counter, b.program_counter, 3);
+  }
+  if (a.index_register != b.index_register) {
+    row("I", a.index_register, b.index_register, 3);
+  }
+  for (int r = 0; r < 16; ++r) {
+    if (a.variable_registers[r] != b.variable_registers[r]) {
+      row("V" + std::string(1, "0123456789ABCDEF"[r]),
+          a.variable_registers[r], b.variable_registers[r], 2);
+    }
+  }
+  if (a.delay_timer != b.delay_timer) {
+    row("DT", a.delay_timer, b.delay_timer, 2);
+  }
+  if (a.sound_timer != b.sound_timer) {
+    row("ST", a.sound_timer, b.sound_timer, 2);
+  }
+  if (a.audio_pitch != b.audio_pitch || a.audio_pattern != b.audio_pattern) {
+    out << "  audio pattern or pitch\n";
+  }
+  if (a.stack_depth != b.stack_depth) {
+    row("depth", a.stack_depth, b.stack_depth, 2);
+  }
+  for (int i = 0; i < Chip8State::kStackSize; ++i) {
+    if (a.stack[i] != b.stack[i]) {
+      row("stack[" + std::to_string(i) + "]", a.stack[i], b.stack[i], 3);
+    }
+  }
+  for (size_t address = 0; address < a.memory.size(); ++address) {
+    if (a.memory[address] != b.memory[address]) {
+      std::ostringstream name;
+      name << "[" << std::hex << std::setfill('0') << std::setw(3) << address
+           << "]";
+      row(name.str(), a.memory[address], b.memory[address], 2);
+    }
+  }
+  for (size_t y = 0; y < a.display.size(); ++y) {
+    if (a.display[y] != b.display[y]) {
+      out << "  display row " << y << "\n";
+    }
+  }
+  if (a.random_counter != b.random_counter) {
+    out << "  random counter " << a_name << " " << a.random_counter << ", "
+        << b_name << " " << b.random_counter << "\n";
+  }
+  if (a.fault != b.fault) {
+    out << "  fault     " << a_name << " " << DescribeFault(a) << ", "
+        << b_name << " " << DescribeFault(b) << "\n";
+  }
+}
+
+// Finds where `BlockEngine` (with `options`) first stops behaving exactly like
+// the interpreter in `Chip8Core` while playing `replay`, and prints the
+// instruction and how the two machines differ after it to `out`. Returns the
+// frame, or -1 if they never differ.
+//
+// Both start from each keyframe in turn and run its chunk, until the first
+// chunk whose end states have different hashes. The frame within that chunk
+// is then found by binary search (each probe re-running both from the
+// keyframe), and the instruction within that frame by running both from the
+// start of the frame one more instruction at a time.
+inline int64_t BisectDivergence(ReplayFile& replay,
+                                const BlockEngineOptions& options,
+                                std::ostream& out) {
+  Chip8Core interpreter, engine_core;
+  BlockEngine engine(options);
+  // Runs both machines `frames` frames from the keyframe of `chunk` and
+  // returns whether they're still the same.
+  auto run = [&](int64_t chunk, int64_t frames) {
+    replay.SeekChunk(chunk, interpreter);
+    replay.SeekChunk(chunk, engine_core);
+    auto first = replay.chunks()[chunk].first_frame;
+    for (auto frame = first; frame < first + frames; ++frame) {
+      auto keys = replay.keys(frame);
+      interpreter.SetKeys(keys);
+      interpreter.RunFrame();
+      engine_core.SetKeys(keys);
+      engine.RunFrame(engine_core);
+    }
+    return HashState(interpreter.state()) == HashState(engine_core.state());
+  };
+
+  auto& chunks = replay.chunks();
+  int64_t chunk = 0;
+  while (chunk < int64_t(chunks.size()) && run(chunk, chunks[chunk].frames)) {
+    ++chunk;
+  }
+  if (chunk == int64_t(chunks.size())) {
+    return -1;
+  }
+
+  // The machines agree after `same` frames of the chunk and not after
+  // `different`.
+  int64_t same = 0;
+  int64_t different = chunks[chunk].frames;
+  while (different - same > 1) {
+    auto middle = (same + different) / 2;
+    (run(chunk, middle) ? same : different) = middle;
+  }
+  auto frame = chunks[chunk].first_frame + same;
+
+  run(chunk, same);
+  Chip8State start = interpreter.state();
+  auto keys = replay.keys(frame);
+  for (int instructions = 1; instructions <= Chip8Core::kInstructionsPerFrame;
+       ++instructions) {
+    interpreter.LoadState(start);
+    interpreter.SetKeys(keys);
+    for (int i = 0; i < instructions - 1; ++i) {
+      interpreter.Step();
+    }
+    auto pc = interpreter.state().program_counter;
+    uint16_t instruction = (interpreter.state().memory[pc] << 8) |
+                           interpreter.state().memory[(pc + 1) % 4096];
+    interpreter.Step();
+    engine_core.LoadState(start);
+    engine_core.SetKeys(keys);
+    engine.Run(engine_core, instructions);
+    if (!(interpreter.state() == engine_core.state())) {
+      out << "Frame " << frame << " diverges at instruction "
+          << instructions - 1 << " of the frame, 0x" << std::hex
+          << std::setfill('0') << std::setw(3) << pc << ": " << std::setw(4)
+          << instruction << std::dec << std::setfill(' ') << " "
+          << Disassemble(instruction) << "\n";
+      PrintStateDiff(out, interpreter.state(), engine_core.state(),
+                     "interpreter", "engine");
+      return frame;
+    }
+  }
+  // Every instruction matched, so either the timers differ or the engine
+  // only goes wrong once it has run the frame a few more times.
+  out << "Frame " << frame
+      << " diverges, but not when run again an instruction at a time:\n";
+  run(chunk, same + 1);
+  PrintStateDiff(out, interpreter.state(), engine_core.state(), "interpreter",
+                 "engine");
+  return frame;
+}
+
+#endif /* DIVERGENCE_BISECTOR_H */
@@ -1,10 +1,534 @@
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "batch-runner.h"
 #include "chip8emulator.h"
+#include "coroutine-scheduler.h"
+#include "divergence-bisector.h"
+#include "replay-verifier.h"
+#include "session-server.h"
+#include "watchdog.h"
+
+// Parses the whole of `text` as a number into `value`, returning false if it
+// isn't one.
+template <typename T>
+bool ParseNumber(const char* text, T& value) {
+  auto end = text + std::strlen(text);
+  auto [last, error] = std::from_chars(text, end, value);
+  return error == std::errc() && last == end;
+}
+
+void PrintUsage(const char* program) {
+  std::cout
+      << "Usage: " << program << " [options] <rom file>\n"
+      << "       " << program
+      << " --headless <frames> [limits] [--record-wav <file>] <rom file>\n"
+      << "       " << program
+      << " --batch <instances> <frames> [limits] [--workers <n>] <rom file>\n"
+      << "       " << program
+      << " --sessions <sessions> <seconds> [--workers <n>] <rom file>\n"
+      << "       " << program
+      << " --verify-replay <replay file> [--workers <n>] <rom file>\n"
+      << "       " << program << " --bisect-replay <replay file> <rom file>\n"
+      << "       " << program << " --check-engine <frames> <rom file>\n"
+      << "       " << program
+      << " --netplay-test <frames> <loss percent> <rom file>\n"
+      << "       " << program
+      << " --serve <socket path> [--workers <n>] [rom file]\n\n"
+      << "Options:\n"
+      << "  --seed <seed>\n"
+      << "  --run-ahead <frames>\n"
+      << "  --watch | --watch-keep-state\n"
+      << "  --record-wav <file>\n"
+      << "  --netplay <local port> <peer host>:<peer port>\n"
+      << "  --tier-thresholds <decode> <fuse>\n"
+      << "  --engine-stats\n"
+      << "  --profile-dir <directory> | --no-profile\n"
+      << "  --startup-times\n"
+      << "  --save-dir <directory>\n"
+      << "  --perf-hud\n"
+      << "  --clock-stats\n"
+      << "  --coverage <report file>\n"
+      << "  --stack-policy halt|wrap|report\n"
+      << "  --debug\n"
+      << "  --record-replay <file> | --play-replay <file>\n\n"
+      << "Limits:\n"
+      << "  --max-instructions <n>\n"
+      << "  --max-seconds <n>" << std::endl;
+}
+
+// Reports why a headless run stopped if it wasn't because it ran for as long as
+// it was asked to. Returns the exit code for the run.
+int ReportResult(const Watchdog& watchdog, WatchdogResult result,
+                 const Chip8Core& core) {
+  if (core.stack_errors() > 0) {
+    std::cout << "The stack overflowed or underflowed " << core.stack_errors()
+              << " times" << std::endl;
+  }
+  if (result == WatchdogResult::kHung) {
+    std::cout << "Hung after " << watchdog.frames()
+              << " frames, repeating every " << watchdog.hang_period()
+              << " frames" << std::endl;
+    return 2;
+  }
+  if (result == WatchdogResult::kFaulted) {
+    std::cout << "Halted after " << watchdog.frames()
+              << " frames: " << DescribeFault(core.state()) << std::endl;
+    return 2;
+  }
+  if (result == WatchdogResult::kWallTimeLimit) {
+    std::cout << "Stopped at the time limit after " << watchdog.frames()
+              << " frames" << std::endl;
+  }
+  return 0;
+}
+
+// Runs the ROM without a window until it reaches one of `limits`. Audio is
+// only synthesized if it is being recorded.
+int RunHeadless(const std::string& rom_file_path, const WatchdogLimits& limits,
+                const EmulatorOptions& options) {
+  Chip8Core core;
+  core.Seed(options.seed.value_or(0));
+  core.SetStackPolicy(options.stack_policy);
+  if (!core.LoadRom(rom_file_path)) {
+    std::cout << "Failed to read " << rom_file_path << std::endl;
+    return 1;
+  }
+  std::unique_ptr<WavRecorder> wav_recorder;
+  if (!options.record_wav_path.empty()) {
+    // Headless runs go faster than real time, so the recording waits for
+    // the disk rather than dropping samples.
+    wav_recorder = std::make_unique<WavRecorder>(options.record_wav_path,
+                                                 /* wait_for_space = */ true);
+    if (!wav_recorder->ok()) {
+      std::cout << "Failed to open " << options.record_wav_path << std::endl;
+      return 1;
+    }
+  }
+
+  BlockEngine engine(options.engine);
+  std::unique_ptr<ProfileCache> profile_cache;
+  std::vector<unsigned char> rom;
+  if (options.use_profile && Chip8Core::ReadRom(rom_file_path, rom)) {
+    profile_cache = std::make_unique<ProfileCache>(options.profile_directory);
+    profile_cache->Load(rom, engine, core);
+  }
+  std::unique_ptr<CoverageMap> coverage;
+  if (!options.coverage_path.empty()) {
+    coverage = std::make_unique<CoverageMap>();
+  }
+  AudioSynth audio_synth;
+  std::vector<int16_t> audio_samples;
+  Watchdog watchdog(limits);
+  watchdog.Start(core);
+  auto result = WatchdogResult::kRunning;
+  while (result == WatchdogResult::kRunning) {
+    if (coverage) {
+      coverage->RunFrame(core);
+    } else {
+      engine.RunFrame(core);
+    }
+    if (wav_recorder) {
+      audio_synth.Render(core.state(), 1 / 60.0, audio_samples);
+      wav_recorder->Push(audio_samples);
+    }
+    result = watchdog.Check(core, /* keys = */ 0);
+  }
+  if (options.print_engine_stats) {
+    engine.DumpStats(std::cout);
+  }
+  if (profile_cache && !profile_cache->Save(rom, engine)) {
+    std::cout << "Failed to save the profile to " << options.profile_directory
+              << std::endl;
+  }
+  if (coverage && (!Chip8Core::ReadRom(rom_file_path, rom) ||
+                   !coverage->WriteReport(options.coverage_path, rom))) {
+    std::cout << "Failed to write " << options.coverage_path << std::endl;
+  }
+  return ReportResult(watchdog, result, core);
+}
+
+// Runs `instances` copies of the ROM headless, each until it reaches one of
+// `limits`, and reports the throughput.
+int RunBatch(const std::string& rom_file_path, int instances,
+             const WatchdogLimits& limits, int workers,
+             const EmulatorOptions& options) {
+  std::vector<unsigned char> rom;
+  if (!Chip8Core::ReadRom(rom_file_path, rom)) {
+    std::cout << "Failed to read " << rom_file_path << std::endl;
+    return 1;
+  }
+  BatchRunner runner(workers, /* pin_threads = */ true,
+                     options.seed.value_or(0), options.engine);
+  auto stats = runner.Run(rom, instances, limits);
+  auto seconds = std::chrono::duration<double>(stats.elapsed).count();
+  std::cout << instances << " instances, " << stats.frames << " frames on "
+            << workers << " workers in " << seconds << "s: "
+            << stats.frames / seconds << " frames/s, "
+            << stats.instructions / seconds << " instructions/s" << std::endl;
+  if (stats.hung > 0 || stats.faulted > 0 || stats.timed_out > 0) {
+    std::cout << "Stopped early: " << stats.hung << " hung, " << stats.faulted
+              << " faulted, " << stats.timed_out << " timed out" << std::endl;
+  }
+  return 0;
+}
+
+// Hosts `count` real time sessions of the ROM for `seconds` on `workers`
+// threads and reports how well they kept up.
+int RunSessions(const std::string& rom_file_path, int count, int seconds,
+                int workers, uint64_t seed) {
+  std::vector<unsigned char> rom;
+  if (!Chip8Core::ReadRom(rom_file_path, rom)) {
+    std::cout << "Failed to read " << rom_file_path << std::endl;
+    return 1;
+  }
+  CoroutineScheduler scheduler(workers);
+  for (int i = 0; i < count; ++i) {
+    scheduler.AddSession(rom, seed + i);
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  std::cout << count << " sessions on " << workers << " workers ran "
+            << scheduler.frames() / double(count * seconds)
+            << " frames/s each (60 is real time)" << std::endl;
+  return 0;
+}
+
+// Plays the ROM for `frames` frames with random keys on both the interpreter
+// and the block engine, and checks that they stay the same. Some frames are
+// started by stepping the engine's core on its own for a few instructions, as
+// the debugger does, before the engine runs the rest.
+int RunCheckEngine(const std::string& rom_file_path, int frames,
+                   const EmulatorOptions& options) {
+  auto seed = options.seed.value_or(0);
+  Chip8Core interpreter, engine_core;
+  for (auto* core : {&interpreter, &engine_core}) {
+    core->Seed(seed);
+    core->SetStackPolicy(options.stack_policy);
+    if (!core->LoadRom(rom_file_path)) {
+      std::cout << "Failed to read " << rom_file_path << std::endl;
+      return 1;
+    }
+  }
+  BlockEngine engine(options.engine);
+  for (int frame = 0; frame < frames; ++frame) {
+    uint16_t keys = CounterRandom(seed, frame / 8);
+    interpreter.SetKeys(keys);
+    interpreter.RunFrame();
+    engine_core.SetKeys(keys);
+    auto random = CounterRandom(seed + 1, frame);
+    int steps = random % 4 == 0
+                    ? (random >> 8) % (Chip8Core::kInstructionsPerFrame + 1)
+                    : 0;
+    for (int i = 0; i < steps; ++i) {
+      engine_core.Step();
+    }
+    engine.Run(engine_core, Chip8Core::kInstructionsPerFrame - steps);
+    engine_core.TickTimers();
+    if (!(interpreter.state() == engine_core.state())) {
+      std::cout << "Frame " << frame << " differs:" << std::endl;
+      PrintStateDiff(std::cout, interpreter.state(), engine_core.state(),
+                     "interpreter", "engine");
+      return 1;
+    }
+  }
+  std::cout << "The engine and the interpreter agree on all " << frames
+            << " frames" << std::endl;
+  return 0;
+}
+
+// Plays the ROM as both peers of a netplay game in this process for `frames`
+// frames, each pressing random keys, over a loopback transport which loses,
+// duplicates and reorders `loss_percent` percent of packets. Then checks the
+// peers ended up in the same state, and reports how much rolling back it took.
+int RunNetplayTest(const std::string& rom_file_path, int frames,
+                   int loss_percent, uint64_t seed) {
+  std::array<Chip8Core, 2> cores;
+  for (auto& core : cores) {
+    core.Seed(seed);
+    if (!core.LoadRom(rom_file_path)) {
+      std::cout << "Failed to read " << rom_file_path << std::endl;
+      return 1;
+    }
+  }
+  auto [transport_a, transport_b] = LoopbackTransport::CreatePair();
+  transport_a->SetLoss(loss_percent, seed + 1);
+  transport_b->SetLoss(loss_percent, seed + 2);
+  RollbackSession a(cores[0], *transport_a);
+  RollbackSession b(cores[1], *transport_b);
+
+  // Both peers hold a random key, a new one every 8 frames, and then nothing
+  // for long enough without loss that every input has been delivered and
+  // every misprediction rolled back.
+  auto end = frames + 8 * RollbackSession::kMaxRollbackFrames;
+  auto advance = [&](RollbackSession& session, uint64_t stream) {
+    if (session.frame() >= end) {
+      return;
+    }
+    uint16_t keys = 0;
+    if (session.frame() < frames) {
+      keys = 1 << (CounterRandom(stream, session.frame() / 8) % 16);
+    }
+    session.AdvanceFrame(keys);
+  };
+  int64_t calls = 0;
+  while (a.frame() < end || b.frame() < end) {
+    if (a.frame() >= frames && b.frame() >= frames) {
+      transport_a->SetLoss(0, 0);
+      transport_b->SetLoss(0, 0);
+    }
+    advance(a, seed + 3);
+    advance(b, seed + 4);
+    if (++calls > 100 * int64_t(end)) {
+      std::cout << "The peers stopped making progress at frames " << a.frame()
+                << " and " << b.frame() << std::endl;
+      return 1;
+    }
+  }
+
+  for (auto* session : {&a, &b}) {
+    auto& stats = session->stats();
+    std::cout << (session == &a ? "Peer A: " : "Peer B: ") << stats.rollbacks
+              << " rollbacks, " << stats.resimulated_frames
+              << " frames resimulated, slowest rollback "
+              << stats.max_rollback_time.count() << "us" << std::endl;
+  }
+  if (!(cores[0].state() == cores[1].state())) {
+    std::cout << "The peers diverged after " << end << " frames:" << std::endl;
+    PrintStateDiff(std::cout, cores[0].state(), cores[1].state(), "A", "B");
+    return 1;
+  }
+  std::cout << "Both peers are in the same state after " << end << " frames"
+            << std::endl;
+  return 0;
+}
+
+// Hosts sessions for clients of the Unix socket at `socket_path` until the
+// process is killed, with `rom_file_path` (if any) already added to its ROMs.
+int RunServer(const std::string& socket_path, int workers,
+              const std::string& rom_file_path) {
+  SessionServer server(socket_path, workers);
+  if (!server.ok()) {
+    std::cout << "Failed to listen on " << socket_path << std::endl;
+    return 1;
+  }
+  if (!rom_file_path.empty()) {
+    std::vector<unsigned char> rom;
+    if (!Chip8Core::ReadRom(rom_file_path, rom)) {
+      std::cout << "Failed to read " << rom_file_path << std::endl;
+      return 1;
+    }
+    std::cout << rom_file_path << " is ROM " << std::hex
+              << server.roms().Add(std::move(rom)) << std::dec << std::endl;
+  }
+  std::cout << "Serving " << socket_path << " on " << workers << " workers"
+            << std::endl;
+  server.Serve();
+  return 1;
+}
+
+// Checks that the replay at `replay_path` of the ROM plays the same in this
+// build as it did when it was recorded.
+int RunVerifyReplay(const std::string& rom_file_path,
+                    const std::string& replay_path, int workers,
+                    const EmulatorOptions& options) {
+  std::vector<unsigned char> rom;
+  ReplayFile replay;
+  if (!Chip8Core::ReadRom(rom_file_path, rom)) {
+    std::cout << "Failed to read " << rom_file_path << std::endl;
+    return 1;
+  }
+  if (!replay.Open(replay_path) || replay.rom_hash() != HashRom(rom)) {
+    std::cout << replay_path << " isn't a replay of " << rom_file_path
+              << std::endl;
+    return 1;
+  }
+  auto verification = VerifyReplay(replay_path, workers, options.engine);
+  auto seconds = std::chrono::duration<double>(verification.elapsed).count();
+  if (!verification.read) {
+    std::cout << replay_path << " is damaged" << std::endl;
+    return 1;
+  }
+  if (verification.first_mismatch >= 0) {
+    std::cout << "Frame " << verification.first_mismatch
+              << " doesn't match the replay" << std::endl;
+    return 1;
+  }
+  std::cout << "All " << verification.frames_checked
+            << " frames match the replay (" << workers << " workers, "
+            << seconds << "s)" << std::endl;
+  return 0;
+}
+
+// Finds the first instruction in the replay at `replay_path` of the ROM where
+// the block engine and the interpreter disagree.
+int RunBisectReplay(const std::string& rom_file_path,
+                    const std::string& replay_path,
+                    const EmulatorOptions& options) {
+  std::vector<unsigned char> rom;
+  ReplayFile replay;
+  if (!Chip8Core::ReadRom(rom_file_path, rom)) {
+    std::cout << "Failed to read " << rom_file_path << std::endl;
+    return 1;
+  }
+  if (!replay.Open(replay_path) || replay.rom_hash() != HashRom(rom)) {
+    std::cout << replay_path << " isn't a replay of " << rom_file_path
+              << std::endl;
+    return 1;
+  }
+  if (BisectDivergence(replay, options.engine, std::cout) >= 0) {
+    return 1;
+  }
+  std::cout << "The engine and the interpreter agree on all "
+            << replay.frames() << " frames" << std::endl;
+  return 0;
+}
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " <rom file>" << std::endl;
+  std::string rom_file_path;
+  EmulatorOptions options;
+  bool headless = false;
+  int batch_instances = 0;
+  WatchdogLimits limits;
+  int sessions = 0;
+  int sessions_seconds = 0;
+  std::string verify_replay_path;
+  std::string bisect_replay_path;
+  std::string serve_path;
+  int netplay_test_frames = 0;
+  int check_engine_frames = 0;
+  int netplay_test_loss = 0;
+  int workers = std::thread::hardware_concurrency();
+  // Set if an option's argument is malformed, e.g. not a number.
+  bool bad_argument = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--seed" && i + 1 < argc) {
+      uint64_t seed = 0;
+      bad_argument |= !ParseNumber(argv[++i], seed);
+      options.seed = seed;
+    } else if (arg == "--run-ahead" && i + 1 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], options.run_ahead_frames);
+    } else if (arg == "--watch") {
+      options.watch_rom = true;
+    } else if (arg == "--watch-keep-state") {
+      options.watch_rom = true;
+      options.watch_rom_keep_state = true;
+    } else if (arg == "--netplay" && i + 2 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], options.netplay_port);
+      std::string peer = argv[++i];
+      auto colon = peer.rfind(':');
+      if (colon == std::string::npos || colon == 0) {
+        bad_argument = true;
+        continue;
+      }
+      options.netplay_peer_host = peer.substr(0, colon);
+      bad_argument |= !ParseNumber(peer.c_str() + colon + 1,
+                                   options.netplay_peer_port);
+    } else if (arg == "--record-wav" && i + 1 < argc) {
+      options.record_wav_path = argv[++i];
+    } else if (arg == "--tier-thresholds" && i + 2 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], options.engine.decode_threshold);
+      bad_argument |= !ParseNumber(argv[++i], options.engine.fuse_threshold);
+    } else if (arg == "--engine-stats") {
+      options.print_engine_stats = true;
+    } else if (arg == "--profile-dir" && i + 1 < argc) {
+      options.profile_directory = argv[++i];
+    } else if (arg == "--no-profile") {
+      options.use_profile = false;
+    } else if (arg == "--startup-times") {
+      options.print_startup_times = true;
+    } else if (arg == "--save-dir" && i + 1 < argc) {
+      options.save_directory = argv[++i];
+    } else if (arg == "--record-replay" && i + 1 < argc) {
+      options.record_replay_path = argv[++i];
+    } else if (arg == "--play-replay" && i + 1 < argc) {
+      options.play_replay_path = argv[++i];
+    } else if (arg == "--debug") {
+      options.debug = true;
+    } else if (arg == "--perf-hud") {
+      options.show_perf_hud = true;
+    } else if (arg == "--clock-stats") {
+      options.print_clock_stats = true;
+    } else if (arg == "--coverage" && i + 1 < argc) {
+      options.coverage_path = argv[++i];
+    } else if (arg == "--stack-policy" && i + 1 < argc) {
+      std::string policy = argv[++i];
+      options.stack_policy = policy == "wrap"     ? StackPolicy::kWrap
+                             : policy == "report" ? StackPolicy::kReport
+                                                  : StackPolicy::kHalt;
+    } else if (arg == "--headless" && i + 1 < argc) {
+      headless = true;
+      bad_argument |= !ParseNumber(argv[++i], limits.max_frames);
+    } else if (arg == "--batch" && i + 2 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], batch_instances);
+      bad_argument |= !ParseNumber(argv[++i], limits.max_frames);
+    } else if (arg == "--max-instructions" && i + 1 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], limits.max_instructions);
+    } else if (arg == "--max-seconds" && i + 1 < argc) {
+      double seconds = 0;
+      bad_argument |= !ParseNumber(argv[++i], seconds);
+      limits.max_wall_time =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::duration<double>(seconds));
+    } else if (arg == "--sessions" && i + 2 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], sessions);
+      bad_argument |= !ParseNumber(argv[++i], sessions_seconds);
+    } else if (arg == "--verify-replay" && i + 1 < argc) {
+      verify_replay_path = argv[++i];
+    } else if (arg == "--bisect-replay" && i + 1 < argc) {
+      bisect_replay_path = argv[++i];
+    } else if (arg == "--check-engine" && i + 1 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], check_engine_frames);
+    } else if (arg == "--netplay-test" && i + 2 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], netplay_test_frames);
+      bad_argument |= !ParseNumber(argv[++i], netplay_test_loss);
+    } else if (arg == "--serve" && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (arg == "--workers" && i + 1 < argc) {
+      bad_argument |= !ParseNumber(argv[++i], workers);
+    } else {
+      rom_file_path = arg;
+    }
+  }
+
+  if (bad_argument) {
+    PrintUsage(argv[0]);
     return 1;
   }
-  Chip8Emulator emulator(argv[1]);
+  if (!serve_path.empty()) {
+    return RunServer(serve_path, std::max(1, workers), rom_file_path);
+  }
+  if (rom_file_path.empty()) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (headless) {
+    return RunHeadless(rom_file_path, limits, options);
+  }
+  if (batch_instances > 0) {
+    return RunBatch(rom_file_path, batch_instances, limits,
+                    std::max(1, workers), options);
+  }
+  if (!verify_replay_path.empty()) {
+    return RunVerifyReplay(rom_file_path, verify_replay_path,
+                           std::max(1, workers), options);
+  }
+  if (!bisect_replay_path.empty()) {
+    return RunBisectReplay(rom_file_path, bisect_replay_path, options);
+  }
+  if (check_engine_frames > 0) {
+    return RunCheckEngine(rom_file_path, check_engine_frames, options);
+  }
+  if (netplay_test_frames > 0) {
+    return RunNetplayTest(rom_file_path, netplay_test_frames,
+                          netplay_test_loss, options.seed.value_or(0));
+  }
+  if (sessions > 0) {
+    return RunSessions(rom_file_path, sessions, sessions_seconds,
+                       std::max(1, workers), options.seed.value_or(0));
+  }
+  Chip8Emulator emulator(rom_file_path, options);
   emulator.BlockingExecute();
 }
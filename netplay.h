@@ -0,0 +1,420 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chip8-core.h"
+#include "counter-random.h"
+
+// The message that netplay peers exchange every frame: the sender's input for
+// a run of consecutive frames, plus the last frame for which the sender has
+// received all of our input. Inputs are resent until they are acknowledged so
+// that a lost packet doesn't lose input.
+struct NetplayPacket {
+  // Enough to cover every frame that a peer can be missing (see
+  // `RollbackSession`).
+  static constexpr int kMaxInputs = 24;
+
+  int32_t ack_frame = -1;
+  int32_t first_frame = 0;
+  int count = 0;
+  std::array<uint16_t, kMaxInputs> keys{};
+
+  // Wire format (little endian): ack_frame:4 first_frame:4 count:1 keys:2*count
+  std::vector<uint8_t> Encode() const {
+    std::vector<uint8_t> bytes;
+    auto put = [&bytes](uint32_t value, int size) {
+      for (int i = 0; i < size; ++i) {
+        bytes.push_back((value >> (8 * i)) & 0xFF);
+      }
+    };
+    put(ack_frame, 4);
+    put(first_frame, 4);
+    put(count, 1);
+    for (int i = 0; i < count; ++i) {
+      put(keys[i], 2);
+    }
+    return bytes;
+  }
+
+  // Returns false if `bytes` isn't a well formed packet.
+  bool Decode(const uint8_t* bytes, size_t size) {
+    auto get = [bytes](size_t offset, int size) {
+      uint32_t value = 0;
+      for (int i = 0; i < size; ++i) {
+        value |= bytes[offset + i] << (8 * i);
+      }
+      return value;
+    };
+    if (size < 9) {
+      return false;
+    }
+    ack_frame = get(0, 4);
+    first_frame = get(4, 4);
+    count = get(8, 1);
+    if (count > kMaxInputs || size != 9 + 2 * static_cast<size_t>(count)) {
+      return false;
+    }
+    for (int i = 0; i < count; ++i) {
+      keys[i] = get(9 + 2 * i, 2);
+    }
+    return true;
+  }
+};
+
+// How netplay packets get to the peer. Delivery is unreliable and unordered;
+// `RollbackSession` copes with lost, duplicated and reordered packets.
+class NetplayTransport {
+public:
+  virtual ~NetplayTransport() = default;
+  virtual void Send(const NetplayPacket& packet) = 0;
+  // Returns false when there are no more packets waiting.
+  virtual bool Receive(NetplayPacket& packet) = 0;
+};
+
+// Connects two peers within the same process: what one end sends the other
+// end receives. Packets still go through the wire format, which makes this a
+// stand in for the network when testing rollback, and `SetLoss` makes it as
+// unreliable as a bad one.
+class LoopbackTransport : public NetplayTransport {
+public:
+  static std::pair<std::unique_ptr<LoopbackTransport>,
+                   std::unique_ptr<LoopbackTransport>>
+  CreatePair() {
+    auto a_to_b = std::make_shared<Channel>();
+    auto b_to_a = std::make_shared<Channel>();
+    return {std::unique_ptr<LoopbackTransport>(
+                new LoopbackTransport(a_to_b, b_to_a)),
+            std::unique_ptr<LoopbackTransport>(
+                new LoopbackTransport(b_to_a, a_to_b))};
+  }
+
+  // From now on `percent` percent of the packets this end sends are lost, as
+  // many again are delivered twice and as many are held back until after the
+  // next packet. Which packets is decided by `seed`, so a lossy run can be
+  // repeated exactly.
+  void SetLoss(int percent, uint64_t seed) {
+    loss_percent_ = percent;
+    loss_seed_ = seed;
+  }
+
+  void Send(const NetplayPacket& packet) override {
+    auto unlucky = [this] {
+      return int(CounterRandom(loss_seed_, sent_++) % 100) < loss_percent_;
+    };
+    if (unlucky()) {
+      return;
+    }
+    auto bytes = packet.Encode();
+    if (held_back_.empty() && unlucky()) {
+      held_back_ = std::move(bytes);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(outgoing_->mutex);
+    auto& packets = outgoing_->packets;
+    packets.push_back(bytes);
+    if (unlucky()) {
+      packets.push_back(bytes);
+    }
+    if (!held_back_.empty()) {
+      packets.push_back(std::move(held_back_));
+      held_back_.clear();
+    }
+  }
+
+  bool Receive(NetplayPacket& packet) override {
+    std::lock_guard<std::mutex> lock(incoming_->mutex);
+    while (!incoming_->packets.empty()) {
+      auto bytes = std::move(incoming_->packets.front());
+      incoming_->packets.pop_front();
+      if (packet.Decode(bytes.data(), bytes.size())) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Channel {
+    std::mutex mutex;
+    std::deque<std::vector<uint8_t>> packets;
+  };
+
+  LoopbackTransport(std::shared_ptr<Channel> outgoing,
+                    std::shared_ptr<Channel> incoming)
+      : outgoing_(std::move(outgoing)), incoming_(std::move(incoming)) {}
+
+  std::shared_ptr<Channel> outgoing_;
+  std::shared_ptr<Channel> incoming_;
+  int loss_percent_ = 0;
+  uint64_t loss_seed_ = 0;
+  uint64_t sent_ = 0;
+  // A packet which is being delivered late.
+  std::vector<uint8_t> held_back_;
+};
+
+// Sends packets to the peer over UDP. Both peers must be able to reach each
+// other's `local_port`; running both on the same machine with
+// "localhost:<port>" works for testing.
+class UdpTransport : public NetplayTransport {
+public:
+  UdpTransport(int local_port, const std::string& remote_host,
+               int remote_port) {
+    socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_ < 0) {
+      std::cout << "Netplay: failed to create socket" << std::endl;
+      return;
+    }
+    fcntl(socket_, F_SETFL, fcntl(socket_, F_GETFL, 0) | O_NONBLOCK);
+
+    sockaddr_in local_address{};
+    local_address.sin_family = AF_INET;
+    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_address.sin_port = htons(local_port);
+    if (bind(socket_, (sockaddr*)&local_address, sizeof(local_address)) < 0) {
+      std::cout << "Netplay: failed to bind port " << local_port << std::endl;
+      return;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(remote_host.c_str(), std::to_string(remote_port).c_str(),
+                    &hints, &result) != 0 ||
+        result == nullptr) {
+      std::cout << "Netplay: failed to resolve " << remote_host << std::endl;
+      return;
+    }
+    remote_address_ = *(sockaddr_in*)result->ai_addr;
+    freeaddrinfo(result);
+    ok_ = true;
+  }
+
+  ~UdpTransport() override {
+    if (socket_ >= 0) {
+      close(socket_);
+    }
+  }
+
+  // False if the socket couldn't be set up.
+  bool ok() const { return ok_; }
+
+  void Send(const NetplayPacket& packet) override {
+    auto bytes = packet.Encode();
+    sendto(socket_, bytes.data(), bytes.size(), /* flags = */ 0,
+           (sockaddr*)&remote_address_, sizeof(remote_address_));
+  }
+
+  bool Receive(NetplayPacket& packet) override {
+    uint8_t buffer[128];
+    while (true) {
+      auto size = recv(socket_, buffer, sizeof(buffer), /* flags = */ 0);
+      if (size < 0) {
+        return false;
+      }
+      if (packet.Decode(buffer, size)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  int socket_ = -1;
+  sockaddr_in remote_address_{};
+  bool ok_ = false;
+};
+
+// Two player netplay using rollback. Every frame the local input is sent to
+// the peer and the game carries on immediately using a prediction of the
+// peer's input (whatever they were last known to be pressing). When the peer's
+// real input arrives and turns out to differ from the prediction the core is
+// rewound to the snapshot taken before the mispredicted frame and the frames
+// since are simulated again with the corrected input.
+//
+// Both players' keys are combined into the single Chip8 keypad; two player
+// Chip8 games already give each player different keys.
+class RollbackSession {
+public:
+  // How far the game may run ahead of the peer's confirmed input. This bounds
+  // both the snapshots kept and the worst case amount of resimulation.
+  static constexpr int kMaxRollbackFrames = 8;
+
+  struct Stats {
+    int rollbacks = 0;
+    int resimulated_frames = 0;
+    // Wall time spent on the most recent and the slowest rollback.
+    std::chrono::microseconds last_rollback_time{0};
+    std::chrono::microseconds max_rollback_time{0};
+  };
+
+  RollbackSession(Chip8Core& core, NetplayTransport& transport)
+      : core_(core), transport_(transport) {}
+
+  // Runs one frame with the local player's `local_keys`. Returns false without
+  // running the frame if the peer has fallen too far behind, in which case the
+  // same call should be retried next frame.
+  bool AdvanceFrame(uint16_t local_keys) {
+    ReceiveRemoteInputs();
+    if (frame_ - confirmed_remote_frame_ - 1 >= kMaxRollbackFrames) {
+      waiting_for_peer_ = true;
+      SendLocalInputs(/* last_frame = */ frame_ - 1);
+      return false;
+    }
+    waiting_for_peer_ = false;
+
+    Rollback();
+
+    auto& current = input(frame_);
+    current.local = local_keys;
+    if (!current.remote_confirmed) {
+      current.remote = input(frame_ - 1).remote;
+    }
+    SendLocalInputs(/* last_frame = */ frame_);
+    SimulateFrame(frame_);
+    ++frame_;
+    return true;
+  }
+
+  // The next frame to be run.
+  int frame() const { return frame_; }
+  bool waiting_for_peer() const { return waiting_for_peer_; }
+  const Stats& stats() const { return stats_; }
+
+private:
+  struct FrameInput {
+    int frame = -1;
+    uint16_t local = 0;
+    uint16_t remote = 0;
+    bool remote_confirmed = false;
+  };
+
+  // Input is kept for longer than snapshots: each peer may only run
+  // kMaxRollbackFrames past the other's confirmed input, so the two can be up
+  // to twice that apart (plus a frame for packets in flight) in either
+  // direction.
+  static constexpr int kMaxPeerDistance = 2 * kMaxRollbackFrames + 1;
+  static constexpr int kInputHistory = 4 * kMaxPeerDistance;
+
+  FrameInput& input(int frame) {
+    auto& slot = inputs_[(frame + kInputHistory) % kInputHistory];
+    if (slot.frame != frame) {
+      slot = FrameInput{.frame = frame};
+    }
+    return slot;
+  }
+
+  Chip8State& snapshot(int frame) {
+    return snapshots_[frame % kMaxRollbackFrames];
+  }
+
+  void SimulateFrame(int frame) {
+    core_.SaveState(snapshot(frame));
+    auto& frame_input = input(frame);
+    core_.SetKeys(frame_input.local | frame_input.remote);
+    core_.RunFrame();
+  }
+
+  void ReceiveRemoteInputs() {
+    NetplayPacket packet;
+    while (transport_.Receive(packet)) {
+      peer_ack_frame_ = std::max(peer_ack_frame_, packet.ack_frame);
+      for (int i = 0; i < packet.count; ++i) {
+        int frame = packet.first_frame + i;
+        // Old input we already have, or input from further ahead than the
+        // peer is allowed to be.
+        if (frame <= confirmed_remote_frame_ ||
+            frame > frame_ + kMaxPeerDistance) {
+          continue;
+        }
+        auto& frame_input = input(frame);
+        if (frame_input.remote_confirmed) {
+          continue;
+        }
+        if (frame < frame_ && frame_input.remote != packet.keys[i]) {
+          first_misprediction_ = std::min(first_misprediction_, frame);
+        }
+        frame_input.remote = packet.keys[i];
+        frame_input.remote_confirmed = true;
+      }
+    }
+
+    while (confirmed_remote_frame_ + 1 < frame_ + kMaxRollbackFrames &&
+           input(confirmed_remote_frame_ + 1).remote_confirmed) {
+      ++confirmed_remote_frame_;
+    }
+  }
+
+  // Sends all of our input from `last_frame` back to the oldest frame that the
+  // peer hasn't acknowledged yet.
+  void SendLocalInputs(int last_frame) {
+    NetplayPacket packet;
+    packet.ack_frame = confirmed_remote_frame_;
+    packet.first_frame = std::max(
+        {peer_ack_frame_ + 1, last_frame - NetplayPacket::kMaxInputs + 1, 0});
+    packet.count = std::max(0, last_frame - packet.first_frame + 1);
+    for (int i = 0; i < packet.count; ++i) {
+      packet.keys[i] = input(packet.first_frame + i).local;
+    }
+    transport_.Send(packet);
+  }
+
+  // Rewinds to the earliest mispredicted frame (if any) and simulates forward
+  // to the present with the input that is known now.
+  void Rollback() {
+    if (first_misprediction_ >= frame_) {
+      first_misprediction_ = INT_MAX;
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    core_.LoadState(snapshot(first_misprediction_));
+    for (int frame = first_misprediction_; frame < frame_; ++frame) {
+      auto& frame_input = input(frame);
+      if (!frame_input.remote_confirmed) {
+        frame_input.remote = input(frame - 1).remote;
+      }
+      SimulateFrame(frame);
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    stats_.rollbacks++;
+    stats_.resimulated_frames += frame_ - first_misprediction_;
+    stats_.last_rollback_time = elapsed;
+    stats_.max_rollback_time = std::max(stats_.max_rollback_time, elapsed);
+    first_misprediction_ = INT_MAX;
+  }
+
+  Chip8Core& core_;
+  NetplayTransport& transport_;
+  std::array<Chip8State, kMaxRollbackFrames> snapshots_;
+  std::array<FrameInput, kInputHistory> inputs_;
+  int frame_ = 0;
+  // The last frame up to which all of the peer's input is known.
+  int confirmed_remote_frame_ = -1;
+  // The last frame up to which the peer has all of our input.
+  int peer_ack_frame_ = -1;
+  int first_misprediction_ = INT_MAX;
+  bool waiting_for_peer_ = false;
+  Stats stats_;
+};
+
+#endif /* NETPLAY_H */
@@ -0,0 +1,109 @@
+#ifndef PERF_HUD_H
+#define PERF_HUD_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Measures how well the emulator is keeping up: emulated instructions and
+// frames per second, how long frames take to run and draw, frames which were
+// dropped because the previous one ran late, and the process's CPU usage.
+//
+// The numbers are only worked out, and turned into text, a couple of times a
+// second. In between, each frame costs a clock read and a push onto a vector,
+// so showing the HUD barely changes what it measures.
+class PerfHud {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit PerfHud(std::chrono::milliseconds frame_period)
+      : frame_period_(frame_period) {
+    Reset(Clock::now());
+  }
+
+  // Call when the work for a frame starts.
+  void FrameStarted() {
+    auto now = Clock::now();
+    if (frame_start_ != Clock::time_point()) {
+      // A frame which starts a whole period or more late means one was
+      // skipped.
+      auto periods = std::lround(std::chrono::duration<double>(
+                                     now - frame_start_) /
+                                 frame_period_);
+      dropped_frames_ += std::max<long>(0, periods - 1);
+    }
+    frame_start_ = now;
+  }
+
+  // Call once the frame is on screen, with the number of instructions that
+  // were emulated for it.
+  void FrameFinished(int64_t instructions) {
+    auto now = Clock::now();
+    frame_times_.push_back(now - frame_start_);
+    instructions_ += instructions;
+    if (now - window_start_ >= kRefreshPeriod) {
+      Refresh(now);
+    }
+  }
+
+  // The latest numbers, as one line of text.
+  const std::string& text() const { return text_; }
+
+private:
+  static constexpr std::chrono::milliseconds kRefreshPeriod{500};
+
+  void Refresh(Clock::time_point now) {
+    auto window = now - window_start_;
+    double seconds = std::chrono::duration<double>(window).count();
+    double cpu_seconds = double(std::clock() - cpu_start_) / CLOCKS_PER_SEC;
+
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(0)
+         << instructions_ / seconds << " instr/s  "
+         << frame_times_.size() / seconds << " fps  "
+         << std::setprecision(1) << "frame " << Percentile(50) << "/"
+         << Percentile(99) << "ms p50/p99  " << dropped_frames_
+         << " dropped  " << std::setprecision(0) << "CPU "
+         << 100 * cpu_seconds / seconds << "%";
+    text_ = text.str();
+    Reset(now);
+  }
+
+  // The `percentile`th percentile of the frame times in milliseconds.
+  double Percentile(int percentile) {
+    if (frame_times_.empty()) {
+      return 0;
+    }
+    auto nth = frame_times_.begin() +
+               (frame_times_.size() - 1) * percentile / 100;
+    std::nth_element(frame_times_.begin(), nth, frame_times_.end());
+    return std::chrono::duration<double, std::milli>(*nth).count();
+  }
+
+  void Reset(Clock::time_point now) {
+    window_start_ = now;
+    cpu_start_ = std::clock();
+    instructions_ = 0;
+    frame_times_.clear();
+  }
+
+  std::chrono::milliseconds frame_period_;
+  Clock::time_point frame_start_;
+  int64_t dropped_frames_ = 0;
+
+  // Since the last refresh.
+  Clock::time_point window_start_;
+  std::clock_t cpu_start_;
+  int64_t instructions_ = 0;
+  std::vector<Clock::duration> frame_times_;
+
+  std::string text_ = "Measuring...";
+};
+
+#endif /* PERF_HUD_H */
@@ -0,0 +1,95 @@
+#ifndef PROFILE_CACHE_H
+#define PROFILE_CACHE_H
+
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "block-engine.h"
+
+// 64 bit FNV-1a hash of a ROM, which names its profile in a `ProfileCache`.
+inline uint64_t HashRom(const std::vector<unsigned char>& rom) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto byte : rom) {
+    hash = (hash ^ byte) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// A directory of `BlockEngine` profiles, one per ROM. Loading a ROM's profile
+// when it starts compiles the blocks that were hot last time it ran, so short
+// sessions don't spend their first few seconds in the interpreter and the
+// decoded tier.
+class ProfileCache {
+public:
+  explicit ProfileCache(const std::string& directory = DefaultDirectory())
+      : directory_(directory) {}
+
+  // `$XDG_CACHE_HOME/chip8-emulator`, falling back to
+  // `~/.cache/chip8-emulator`.
+  static std::string DefaultDirectory() {
+    if (auto* cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+      return std::string(cache) + "/chip8-emulator";
+    }
+    if (auto* home = std::getenv("HOME"); home && *home) {
+      return std::string(home) + "/.cache/chip8-emulator";
+    }
+    return ".chip8-emulator";
+  }
+
+  // Loads the profile for `rom` into `engine`, compiling its blocks against
+  // `core`, which should have `rom` loaded. Returns false if there's no
+  // profile for the ROM yet.
+  bool Load(const std::vector<unsigned char>& rom, BlockEngine& engine,
+            Chip8Core& core) const {
+    std::ifstream in(PathFor(rom));
+    return in && engine.LoadProfile(in, core);
+  }
+
+  // Replaces the profile for `rom` with `engine`'s. The profile is written
+  // alongside and then renamed into place, so sessions of the same ROM which
+  // finish together never leave a torn file.
+  bool Save(const std::vector<unsigned char>& rom,
+            const BlockEngine& engine) const {
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    if (error) {
+      return false;
+    }
+    auto path = PathFor(rom);
+    auto temporary_path = path + "." + std::to_string(::getpid()) + ".tmp";
+    {
+      std::ofstream out(temporary_path);
+      engine.SaveProfile(out);
+      if (!out) {
+        std::remove(temporary_path.c_str());
+        return false;
+      }
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::string PathFor(const std::vector<unsigned char>& rom) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".profile", HashRom(rom));
+    return directory_ + "/" + name;
+  }
+
+private:
+  std::string directory_;
+};
+
+#endif /* PROFILE_CACHE_H */
@@ -0,0 +1,513 @@
+#ifndef REPLAY_FILE_H
+#define REPLAY_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chip8-core.h"
+#include "profile-cache.h"
+#include "state-file.h"
+
+// Replays are the keys held in every frame of a game, split into chunks which
+// each start with a snapshot of the machine (a keyframe). Seeking to a frame
+// only has to load the keyframe before it and run the frames since, so a
+// player can jump anywhere in an hour long replay instantly. Each frame also
+// has a hash of the machine's state as it started, which lets a replay be
+// checked against another build of the emulator; see `VerifyReplay`. The
+// layout is:
+//
+//   "chip8-replay 2\n", the ROM's `HashRom` (8 bytes)
+//   chunks, each made of (as LEB128 varints unless noted):
+//     first frame, frame count,
+//     1 if the keyframe is where the last chunk's frames left the machine,
+//       or 0 if the machine jumped to it (e.g. a save state was loaded),
+//     packed keyframe size, packed keyframe (bytes),
+//     packed keys size, packed keys (bytes),
+//     hashes size, the low 32 bits of each frame's `HashState` (4 bytes each)
+//   index: chunk count, then each chunk's first frame, frame count, follows
+//     flag and offset
+//   offset of the index (8 bytes), "chip8-index\n"
+//
+// Keyframes are `WriteState` XORed with the first keyframe, which makes
+// everything but the parts of memory and registers the game changed zero, and
+// the keys are XORed with the previous frame's keys. Both are then packed by
+// run-length encoding their zeros; an hour long replay is about a megabyte,
+// most of which is hashes.
+//
+// A replay which was never finished (e.g. the emulator crashed) has no index,
+// in which case the chunks are found by reading through the file.
+namespace replay_file {
+
+constexpr int kKeyframeInterval = 60;
+constexpr char kMagic[] = "chip8-replay 2\n";
+constexpr char kIndexMagic[] = "chip8-index\n";
+
+inline void WriteVarint(std::ostream& out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    out.put(byte | (value ? 0x80 : 0));
+  } while (value);
+}
+
+// Returns false if `in` ran out first.
+inline bool ReadVarint(std::istream& in, uint64_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    auto byte = in.get();
+    if (byte == std::istream::traits_type::eof()) {
+      return false;
+    }
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Packs `bytes` as pairs of a run of zeros and a run of other bytes: the
+// length of each as a varint followed by the other bytes themselves.
+inline std::string PackZeros(const std::string& bytes) {
+  std::ostringstream packed;
+  size_t i = 0;
+  while (i < bytes.size()) {
+    auto zeros = i;
+    while (i < bytes.size() && bytes[i] == 0) {
+      ++i;
+    }
+    auto literals = i;
+    // Single zeros between other bytes are cheaper to keep as they are.
+    while (i < bytes.size() &&
+           (bytes[i] != 0 || (i + 1 < bytes.size() && bytes[i + 1] != 0))) {
+      ++i;
+    }
+    WriteVarint(packed, literals - zeros);
+    WriteVarint(packed, i - literals);
+    packed.write(bytes.data() + literals, i - literals);
+  }
+  return packed.str();
+}
+
+inline bool UnpackZeros(const std::string& packed, std::string& bytes) {
+  std::istringstream in(packed);
+  bytes.clear();
+  uint64_t zeros, literals;
+  while (ReadVarint(in, zeros)) {
+    // Nothing packed is anywhere near this big, so it's a damaged file.
+    constexpr uint64_t kMaxSize = 1 << 24;
+    if (!ReadVarint(in, literals) ||
+        bytes.size() + zeros + literals > kMaxSize) {
+      return false;
+    }
+    bytes.append(zeros, 0);
+    auto start = bytes.size();
+    bytes.resize(start + literals);
+    if (!in.read(bytes.data() + start, literals)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// XORs `bytes` with as much of `reference` as overlaps it.
+inline void Xor(std::string& bytes, const std::string& reference) {
+  for (size_t i = 0; i < std::min(bytes.size(), reference.size()); ++i) {
+    bytes[i] ^= reference[i];
+  }
+}
+
+// Where a chunk of a replay is and what it holds.
+struct Chunk {
+  int64_t first_frame;
+  int64_t frames;
+  // Whether the chunk carries on from the one before.
+  bool follows;
+  uint64_t offset;
+};
+
+} // namespace replay_file
+
+// Writes a replay while a game is played.
+class ReplayRecorder {
+public:
+  ReplayRecorder(const std::string& path,
+                 const std::vector<unsigned char>& rom)
+      : out_(path, std::ios::binary) {
+    out_.write(replay_file::kMagic, sizeof(replay_file::kMagic) - 1);
+    auto rom_hash = HashRom(rom);
+    for (int i = 0; i < 8; ++i) {
+      out_.put((rom_hash >> (8 * i)) & 0xFF);
+    }
+  }
+
+  // Finishes the last chunk and writes the index.
+  ~ReplayRecorder() {
+    if (!out_) {
+      return;
+    }
+    Cut();
+    uint64_t index_offset = out_.tellp();
+    replay_file::WriteVarint(out_, index_.size());
+    for (auto& chunk : index_) {
+      replay_file::WriteVarint(out_, chunk.first_frame);
+      replay_file::WriteVarint(out_, chunk.frames);
+      replay_file::WriteVarint(out_, chunk.follows);
+      replay_file::WriteVarint(out_, chunk.offset);
+    }
+    for (int i = 0; i < 8; ++i) {
+      out_.put((index_offset >> (8 * i)) & 0xFF);
+    }
+    out_.write(replay_file::kIndexMagic, sizeof(replay_file::kIndexMagic) - 1);
+  }
+
+  ReplayRecorder(const ReplayRecorder&) = delete;
+  ReplayRecorder& operator=(const ReplayRecorder&) = delete;
+
+  // False if the file couldn't be written.
+  bool ok() const { return bool(out_); }
+
+  // Records a frame which is about to be run from `state` with `keys`.
+  void RecordFrame(const Chip8State& state, uint16_t keys) {
+    if (keys_.empty()) {
+      keyframe_ = state;
+    }
+    keys_.push_back(keys);
+    hashes_.push_back(HashState(state));
+    ++frames_;
+    if (keys_.size() == replay_file::kKeyframeInterval) {
+      Flush();
+      next_follows_ = true;
+    }
+  }
+
+  // Starts a new chunk at the next frame because the machine has jumped to a
+  // state which it didn't run its way to.
+  void Cut() {
+    Flush();
+    next_follows_ = false;
+  }
+
+private:
+  // Writes the chunk being recorded.
+  void Flush() {
+    if (keys_.empty()) {
+      return;
+    }
+    std::ostringstream state;
+    WriteState(state, keyframe_);
+    auto state_bytes = state.str();
+    if (index_.empty()) {
+      reference_ = state_bytes;
+    } else {
+      replay_file::Xor(state_bytes, reference_);
+    }
+    std::string key_bytes;
+    uint16_t previous = 0;
+    for (auto keys : keys_) {
+      uint16_t changed = keys ^ previous;
+      key_bytes += char(changed & 0xFF);
+      key_bytes += char(changed >> 8);
+      previous = keys;
+    }
+
+    index_.push_back({.first_frame = frames_ - int64_t(keys_.size()),
+                      .frames = int64_t(keys_.size()),
+                      .follows = next_follows_,
+                      .offset = uint64_t(out_.tellp())});
+    replay_file::WriteVarint(out_, index_.back().first_frame);
+    replay_file::WriteVarint(out_, index_.back().frames);
+    replay_file::WriteVarint(out_, index_.back().follows);
+    for (auto* bytes : {&state_bytes, &key_bytes}) {
+      auto packed = replay_file::PackZeros(*bytes);
+      replay_file::WriteVarint(out_, packed.size());
+      out_.write(packed.data(), packed.size());
+    }
+    replay_file::WriteVarint(out_, hashes_.size() * 4);
+    for (auto hash : hashes_) {
+      for (int i = 0; i < 4; ++i) {
+        out_.put((hash >> (8 * i)) & 0xFF);
+      }
+    }
+    keys_.clear();
+    hashes_.clear();
+  }
+
+  std::ofstream out_;
+  std::vector<replay_file::Chunk> index_;
+  // The first keyframe, which the others are stored relative to.
+  std::string reference_;
+  // The chunk being recorded.
+  Chip8State keyframe_;
+  std::vector<uint16_t> keys_;
+  std::vector<uint64_t> hashes_;
+  bool next_follows_ = false;
+  int64_t frames_ = 0;
+};
+
+// Reads a replay for playing back or seeking through.
+class ReplayFile {
+public:
+  // Returns false if `path` isn't a replay.
+  bool Open(const std::string& path) {
+    in_.open(path, std::ios::binary);
+    char magic[sizeof(replay_file::kMagic) - 1];
+    if (!in_.read(magic, sizeof(magic)) ||
+        std::string(magic, sizeof(magic)) != replay_file::kMagic) {
+      return false;
+    }
+    rom_hash_ = 0;
+    for (int i = 0; i < 8; ++i) {
+      rom_hash_ |= uint64_t(uint8_t(in_.get())) << (8 * i);
+    }
+    uint64_t chunks_start = in_.tellg();
+    if (!ReadIndex()) {
+      ScanChunks(chunks_start);
+    }
+    loaded_chunk_ = -1;
+    return !index_.empty() && LoadChunk(0);
+  }
+
+  // The `HashRom` of the ROM which was played.
+  uint64_t rom_hash() const { return rom_hash_; }
+
+  int64_t frames() const {
+    return index_.empty() ? 0
+                          : index_.back().first_frame + index_.back().frames;
+  }
+
+  // Puts `core` at the start of `frame` (up to `frames()`), by loading the
+  // keyframe before it and running the frames in between. Returns false if
+  // the replay is damaged.
+  bool Seek(int64_t frame, Chip8Core& core) {
+    frame = std::clamp<int64_t>(frame, 0, frames());
+    auto chunk = ChunkFor(frame);
+    if (!LoadChunk(chunk)) {
+      return false;
+    }
+    core.LoadState(keyframe_);
+    for (auto f = index_[chunk].first_frame; f < frame; ++f) {
+      core.SetKeys(keys(f));
+      core.RunFrame();
+    }
+    return true;
+  }
+
+  // The keys held in `frame`, or none past the end.
+  uint16_t keys(int64_t frame) {
+    return LoadFrame(frame) ? keys_[frame - first_loaded_frame()] : 0;
+  }
+
+  // The low 32 bits of the `HashState` of the machine as `frame` started, or
+  // 0 past the end.
+  uint32_t hash(int64_t frame) {
+    return LoadFrame(frame) ? hashes_[frame - first_loaded_frame()] : 0;
+  }
+
+  const std::vector<replay_file::Chunk>& chunks() const { return index_; }
+
+  // Loads the keyframe of `chunk` into `core`. Returns false if the replay is
+  // damaged.
+  bool SeekChunk(int64_t chunk, Chip8Core& core) {
+    if (!LoadChunk(chunk)) {
+      return false;
+    }
+    core.LoadState(keyframe_);
+    return true;
+  }
+
+private:
+  using Chunk = replay_file::Chunk;
+
+  // Loads the chunk holding `frame`, if it isn't already. Returns false if
+  // `frame` is past the end or the replay is damaged.
+  bool LoadFrame(int64_t frame) {
+    if (loaded_chunk_ >= 0 && frame >= first_loaded_frame() &&
+        frame < first_loaded_frame() + index_[loaded_chunk_].frames) {
+      return true;
+    }
+    return frame < frames() && LoadChunk(ChunkFor(frame));
+  }
+
+  int64_t first_loaded_frame() const {
+    return index_[loaded_chunk_].first_frame;
+  }
+
+  // The last chunk which starts at or before `frame`.
+  int64_t ChunkFor(int64_t frame) const {
+    return std::upper_bound(index_.begin(), index_.end(), frame,
+                            [](int64_t frame, const Chunk& chunk) {
+                              return frame < chunk.first_frame;
+                            }) -
+           index_.begin() - 1;
+  }
+
+  bool ReadIndex() {
+    constexpr int kIndexMagicSize = sizeof(replay_file::kIndexMagic) - 1;
+    // Each chunk's entry is four varints of at least a byte.
+    constexpr int kMinEntrySize = 4;
+    in_.seekg(0, std::ios::end);
+    uint64_t length = in_.tellg();
+    in_.seekg(-(8 + kIndexMagicSize), std::ios::end);
+    uint64_t index_offset = 0;
+    for (int i = 0; i < 8; ++i) {
+      index_offset |= uint64_t(uint8_t(in_.get())) << (8 * i);
+    }
+    char magic[kIndexMagicSize];
+    if (!in_.read(magic, sizeof(magic)) ||
+        std::string(magic, sizeof(magic)) != replay_file::kIndexMagic) {
+      in_.clear();
+      return false;
+    }
+    in_.seekg(index_offset);
+    // A damaged count could be anything, so it's checked against the size of
+    // the file before anything is allocated for it.
+    uint64_t count;
+    if (!replay_file::ReadVarint(in_, count) ||
+        count > (length - uint64_t(in_.tellg())) / kMinEntrySize) {
+      in_.clear();
+      return false;
+    }
+    index_.resize(count);
+    // `ChunkFor` searches the chunks by their first frames, so each must
+    // start where the one before ended, as `ScanChunks` requires.
+    uint64_t next_frame = 0;
+    for (auto& chunk : index_) {
+      uint64_t first_frame, frames, follows;
+      if (!replay_file::ReadVarint(in_, first_frame) ||
+          !replay_file::ReadVarint(in_, frames) ||
+          !replay_file::ReadVarint(in_, follows) ||
+          !replay_file::ReadVarint(in_, chunk.offset) ||
+          first_frame != next_frame || frames == 0 ||
+          frames > replay_file::kKeyframeInterval) {
+        index_.clear();
+        in_.clear();
+        return false;
+      }
+      chunk.first_frame = first_frame;
+      chunk.frames = frames;
+      chunk.follows = follows;
+      next_frame += frames;
+    }
+    return true;
+  }
+
+  // Rebuilds the index by reading every chunk in turn, up to the first one
+  // which is incomplete or doesn't carry on from the one before (i.e. is
+  // part of an index that was being written).
+  void ScanChunks(uint64_t offset) {
+    in_.seekg(0, std::ios::end);
+    uint64_t length = in_.tellg();
+    in_.seekg(offset);
+    while (true) {
+      Chunk chunk{.offset = uint64_t(in_.tellg())};
+      uint64_t first_frame, count, follows, size;
+      if (!replay_file::ReadVarint(in_, first_frame) ||
+          !replay_file::ReadVarint(in_, count) ||
+          !replay_file::ReadVarint(in_, follows) ||
+          int64_t(first_frame) != frames() || count == 0 ||
+          count > replay_file::kKeyframeInterval) {
+        break;
+      }
+      bool complete = true;
+      for (int part = 0; part < 3 && complete; ++part) {
+        complete = replay_file::ReadVarint(in_, size) &&
+                   uint64_t(in_.tellg()) + size <= length &&
+                   in_.seekg(size, std::ios::cur);
+      }
+      if (!complete) {
+        break;
+      }
+      chunk.first_frame = first_frame;
+      chunk.frames = count;
+      chunk.follows = follows;
+      index_.push_back(chunk);
+    }
+    in_.clear();
+  }
+
+  bool LoadChunk(int64_t chunk) {
+    if (chunk == loaded_chunk_) {
+      return true;
+    }
+    if (chunk < 0 || chunk >= int64_t(index_.size())) {
+      return false;
+    }
+    in_.seekg(index_[chunk].offset);
+    uint64_t first_frame, frames, follows;
+    std::string parts[3];
+    if (!replay_file::ReadVarint(in_, first_frame) ||
+        !replay_file::ReadVarint(in_, frames) ||
+        !replay_file::ReadVarint(in_, follows)) {
+      in_.clear();
+      return false;
+    }
+    // `keys` and `hash` index the chunk's frames by the index's entry, so a
+    // chunk which disagrees with it is damaged.
+    if (int64_t(first_frame) != index_[chunk].first_frame ||
+        int64_t(frames) != index_[chunk].frames) {
+      return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+      uint64_t size;
+      std::string packed;
+      if (!replay_file::ReadVarint(in_, size) || size > 1 << 24) {
+        in_.clear();
+        return false;
+      }
+      packed.resize(size);
+      if (!in_.read(packed.data(), size)) {
+        in_.clear();
+        return false;
+      }
+      // The hashes aren't packed.
+      if (i == 2) {
+        parts[i] = std::move(packed);
+      } else if (!replay_file::UnpackZeros(packed, parts[i])) {
+        return false;
+      }
+    }
+
+    // `Open` loads the first chunk, so the reference is always there for the
+    // others.
+    if (chunk == 0) {
+      reference_ = parts[0];
+    } else {
+      replay_file::Xor(parts[0], reference_);
+    }
+    std::istringstream state(parts[0]);
+    if (!ReadState(state, keyframe_) || parts[1].size() != 2 * frames ||
+        parts[2].size() != 4 * frames) {
+      return false;
+    }
+    keys_.resize(frames);
+    hashes_.resize(frames);
+    uint16_t previous = 0;
+    for (size_t f = 0; f < frames; ++f) {
+      previous ^= uint8_t(parts[1][2 * f]) | uint8_t(parts[1][2 * f + 1]) << 8;
+      keys_[f] = previous;
+      hashes_[f] = 0;
+      for (int i = 0; i < 4; ++i) {
+        hashes_[f] |= uint32_t(uint8_t(parts[2][4 * f + i])) << (8 * i);
+      }
+    }
+    loaded_chunk_ = chunk;
+    return true;
+  }
+
+  std::ifstream in_;
+  uint64_t rom_hash_ = 0;
+  std::vector<Chunk> index_;
+  std::string reference_;
+  // The chunk that was loaded last.
+  int64_t loaded_chunk_ = -1;
+  Chip8State keyframe_;
+  std::vector<uint16_t> keys_;
+  std::vector<uint32_t> hashes_;
+};
+
+#endif /* REPLAY_FILE_H */
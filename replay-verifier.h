@@ -0,0 +1,110 @@
+#ifndef REPLAY_VERIFIER_H
+#define REPLAY_VERIFIER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block-engine.h"
+#include "chip8-core.h"
+#include "replay-file.h"
+#include "state-file.h"
+
+struct ReplayVerification {
+  // False if the replay couldn't be read.
+  bool read = false;
+  // The first frame which didn't leave the machine in the state that was
+  // recorded, or -1 if they all did.
+  int64_t first_mismatch = -1;
+  int64_t frames_checked = 0;
+  std::chrono::nanoseconds elapsed{0};
+};
+
+// Checks that this build of the emulator plays the replay at `path` exactly
+// as the build that recorded it did, by comparing the state after every frame
+// with the hash that was recorded.
+//
+// Since every chunk of a replay starts from a keyframe, the chunks don't
+// depend on each other and are shared out between `num_workers` threads, each
+// with its own copy of the replay and its own `BlockEngine`. Workers take the
+// next unchecked chunk in order, so the earliest mismatch is found first and
+// the others stop once there's nothing before it left to check.
+inline ReplayVerification VerifyReplay(const std::string& path,
+                                       int num_workers,
+                                       const BlockEngineOptions& engine = {}) {
+  auto start = std::chrono::steady_clock::now();
+  ReplayVerification verification;
+  ReplayFile replay;
+  if (!replay.Open(path)) {
+    return verification;
+  }
+  auto& chunks = replay.chunks();
+
+  std::atomic<int64_t> next_chunk = 0;
+  std::atomic<int64_t> first_mismatch = std::numeric_limits<int64_t>::max();
+  std::atomic<int64_t> frames_checked = 0;
+  std::atomic<bool> read = true;
+  std::vector<std::thread> workers;
+  for (int worker = 0; worker < std::max(1, num_workers); ++worker) {
+    workers.emplace_back([&]() {
+      ReplayFile replay;
+      if (!replay.Open(path)) {
+        read = false;
+        return;
+      }
+      Chip8Core core;
+      BlockEngine block_engine(engine);
+      int64_t checked = 0;
+      for (auto chunk = next_chunk++; chunk < int64_t(chunks.size());
+           chunk = next_chunk++) {
+        auto first = chunks[chunk].first_frame;
+        auto end = first + chunks[chunk].frames;
+        if (first >= first_mismatch) {
+          break;
+        }
+        // The state after the chunk's last frame is only known if the next
+        // chunk carries on from it.
+        bool check_last = chunk + 1 < int64_t(chunks.size()) &&
+                          chunks[chunk + 1].follows;
+        if (!replay.SeekChunk(chunk, core)) {
+          read = false;
+          break;
+        }
+        for (auto frame = first; frame < end; ++frame) {
+          core.SetKeys(replay.keys(frame));
+          block_engine.RunFrame(core);
+          if (frame + 1 == end && !check_last) {
+            break;
+          }
+          ++checked;
+          if (uint32_t(HashState(core.state())) != replay.hash(frame + 1)) {
+            auto mismatch = first_mismatch.load();
+            while (frame < mismatch &&
+                   !first_mismatch.compare_exchange_weak(mismatch, frame)) {
+            }
+            break;
+          }
+        }
+      }
+      frames_checked += checked;
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  verification.read = read;
+  if (first_mismatch != std::numeric_limits<int64_t>::max()) {
+    verification.first_mismatch = first_mismatch;
+  }
+  verification.frames_checked = frames_checked;
+  verification.elapsed = std::chrono::steady_clock::now() - start;
+  return verification;
+}
+
+#endif /* REPLAY_VERIFIER_H */
@@ -0,0 +1,71 @@
+#ifndef ROM_WATCHER_H
+#define ROM_WATCHER_H
+
+#include <string>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Watches a ROM file for changes so that it can be reloaded into a running
+// emulator as soon as it is rebuilt. Only implemented on Linux (using
+// inotify); elsewhere `Changed` never reports a change.
+class RomWatcher {
+public:
+  RomWatcher(const std::string& rom_file_path) {
+#ifdef __linux__
+    // Watch the directory rather than the file itself: many tools write a new
+    // file and rename it over the old one, which would silently end a watch on
+    // the old file.
+    auto slash = rom_file_path.rfind('/');
+    auto directory =
+        slash == std::string::npos ? "." : rom_file_path.substr(0, slash + 1);
+    file_name_ = slash == std::string::npos ? rom_file_path
+                                            : rom_file_path.substr(slash + 1);
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ >= 0) {
+      inotify_add_watch(inotify_fd_, directory.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+#endif
+  }
+
+  ~RomWatcher() {
+#ifdef __linux__
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+    }
+#endif
+  }
+
+  RomWatcher(const RomWatcher&) = delete;
+  RomWatcher& operator=(const RomWatcher&) = delete;
+
+  // Returns true if the ROM has been rewritten since the last call. This never
+  // blocks, so it is cheap enough to call every frame.
+  bool Changed() {
+    bool changed = false;
+#ifdef __linux__
+    alignas(inotify_event) char buffer[4096];
+    ssize_t size;
+    while (inotify_fd_ >= 0 &&
+           (size = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+      for (char* event_ptr = buffer; event_ptr < buffer + size;) {
+        auto* event = reinterpret_cast<inotify_event*>(event_ptr);
+        if (event->len > 0 && file_name_ == event->name) {
+          changed = true;
+        }
+        event_ptr += sizeof(inotify_event) + event->len;
+      }
+    }
+#endif
+    return changed;
+  }
+
+private:
+  int inotify_fd_ = -1;
+  std::string file_name_;
+};
+
+#endif /* ROM_WATCHER_H */
@@ -0,0 +1,211 @@
+#ifndef SAVE_SLOTS_H
+#define SAVE_SLOTS_H
+
+#include <array>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "chip8-core.h"
+#include "profile-cache.h"
+#include "state-file.h"
+
+// Numbered save states for one ROM, kept in a directory. Each slot is a state
+// file plus a 1 bit PBM thumbnail of the display, which any image viewer can
+// show.
+//
+// Saving only copies the state into the slot's buffer; a background thread
+// writes it out, so a slow disk never makes the game hitch. Saving the same
+// slot again before the last one was written just replaces the buffer.
+class SaveSlots {
+public:
+  static constexpr int kNumSlots = 4;
+
+  SaveSlots(const std::vector<unsigned char>& rom,
+            const std::string& directory = DefaultDirectory())
+      : directory_(directory), rom_name_(RomName(rom)),
+        writer_([this]() { WriteSlots(); }) {}
+
+  // Writes any saves which are still pending.
+  ~SaveSlots() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+  }
+
+  SaveSlots(const SaveSlots&) = delete;
+  SaveSlots& operator=(const SaveSlots&) = delete;
+
+  // `$XDG_DATA_HOME/chip8-emulator/saves`, falling back to
+  // `~/.local/share/chip8-emulator/saves`.
+  static std::string DefaultDirectory() {
+    if (auto* data = std::getenv("XDG_DATA_HOME"); data && *data) {
+      return std::string(data) + "/chip8-emulator/saves";
+    }
+    if (auto* home = std::getenv("HOME"); home && *home) {
+      return std::string(home) + "/.local/share/chip8-emulator/saves";
+    }
+    return ".chip8-emulator/saves";
+  }
+
+  // Saves `state` to `slot` (0 to `kNumSlots` - 1) in the background.
+  void Save(int slot, const Chip8State& state) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // The state is a plain value, so copying it under the lock never
+      // allocates.
+      slots_[slot].state = state;
+      slots_[slot].loaded = true;
+      slots_[slot].dirty = true;
+    }
+    wake_.notify_one();
+  }
+
+  // Reads the state in `slot` into `state`, including one which is still
+  // being written. Returns false if the slot is empty.
+  //
+  // Only the first load of a slot which hasn't been saved this session reads
+  // its file; after that the slot's state is kept here, so a load never
+  // waits on the writer however slow the disk is.
+  bool Load(int slot, Chip8State& state) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (slots_[slot].loaded) {
+        state = slots_[slot].state;
+        return true;
+      }
+    }
+    // The writer only writes slots which have been saved, so it never
+    // touches this file.
+    std::ifstream in(PathFor(slot, ".state"), std::ios::binary);
+    if (!in || !ReadState(in, state)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!slots_[slot].loaded) {
+      slots_[slot].state = state;
+      slots_[slot].loaded = true;
+    }
+    return true;
+  }
+
+  std::string PathFor(int slot, const std::string& extension) const {
+    return directory_ + "/" + rom_name_ + "-" + std::to_string(slot + 1) +
+           extension;
+  }
+
+private:
+  struct Slot {
+    // The slot's latest state, if `loaded`.
+    Chip8State state;
+    // Whether the slot has been saved or read from its file this session.
+    bool loaded = false;
+    // Whether `state` is still to be written.
+    bool dirty = false;
+  };
+
+  static std::string RomName(const std::vector<unsigned char>& rom) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64, HashRom(rom));
+    return name;
+  }
+
+  void WriteSlots() {
+    Chip8State state;
+    while (true) {
+      int slot = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto dirty = [&]() {
+          for (slot = 0; slot < kNumSlots; ++slot) {
+            if (slots_[slot].dirty) {
+              return true;
+            }
+          }
+          return false;
+        };
+        wake_.wait(lock, [&]() { return dirty() || stop_; });
+        if (slot == kNumSlots) {
+          return;
+        }
+        state = slots_[slot].state;
+        slots_[slot].dirty = false;
+      }
+      if (!Write(slot, state)) {
+        std::cout << "Failed to save slot " << slot + 1 << " to "
+                  << directory_ << std::endl;
+      }
+    }
+  }
+
+  bool Write(int slot, const Chip8State& state) const {
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    if (error) {
+      return false;
+    }
+    // The thumbnail is a PBM: a header and then each row packed into bytes,
+    // most significant bit (and 1 for black) first. Pixels which are on are
+    // drawn white, as in the emulator.
+    if (!WriteReplacing(PathFor(slot, ".pbm"), [&](std::ostream& out) {
+          out << "P4\n"
+              << Chip8Core::kDisplayWidth << " " << Chip8Core::kDisplayHeight
+              << "\n";
+          for (auto row : state.display) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+              out.put(~(row >> shift) & 0xFF);
+            }
+          }
+        })) {
+      return false;
+    }
+    return WriteReplacing(PathFor(slot, ".state"), [&](std::ostream& out) {
+      WriteState(out, state);
+    });
+  }
+
+  // Writes a file alongside `path` with `write` and then renames it into
+  // place, so a crash never leaves a torn save.
+  template <typename WriteFunction>
+  static bool WriteReplacing(const std::string& path, WriteFunction write) {
+    auto temporary_path = path + ".tmp";
+    {
+      std::ofstream out(temporary_path, std::ios::binary);
+      write(out);
+      if (!out) {
+        std::remove(temporary_path.c_str());
+        return false;
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::string directory_;
+  std::string rom_name_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::array<Slot, kNumSlots> slots_;
+  bool stop_ = false;
+  std::thread writer_;
+};
+
+#endif /* SAVE_SLOTS_H */
@@ -2,10 +2,14 @@
 #define SCREEN_H
 
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_ttf.h>
+#include <functional>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
+#include "bitmap-font.h"
 #include "sdl-ptrs.h"
+#include "startup-timer.h"
 
 struct Color {
   unsigned char r, g, b;
@@ -26,21 +30,31 @@ struct Color {
   }
 };
 
-// A nice wrapper around an SDL screen.
+// A nice wrapper around an SDL screen. SDL is only initialized once a
+// `Screen` is created, so headless runs never touch it.
 class Screen {
 public:
-  Screen(const std::string& title) {
+  // With a `startup_timer`, the time taken by each step of opening the window
+  // is recorded in it.
+  Screen(const std::string& title, StartupTimer* startup_timer = nullptr) {
+    auto begin = StartupTimer::Clock::now();
+    auto record = [&](const std::string& phase) {
+      if (startup_timer) {
+        startup_timer->Record(phase, begin);
+      }
+      begin = StartupTimer::Clock::now();
+    };
     SDL_Init(SDL_INIT_VIDEO);
-    TTF_Init();
+    record("SDL video init");
     SDL_DisplayMode display_mode;
     SDL_GetCurrentDisplayMode(/* display_index = */ 0, &display_mode);
     width_ = display_mode.w;
     height_ = display_mode.h;
-    font_ = TTF_OpenFont("./font.ttf", /* size = */ 24);
 
     window_.reset(SDL_CreateWindow(title.c_str(), /* x= */ 0, /* y= */ 0,
                                    width_, height_, SDL_WINDOW_SHOWN));
     window_surface_.reset(SDL_GetWindowSurface(window_.get()));
+    record("create window");
 
 // For some reason unknown to me, the window renderer needs to be created
 // in a different way depending on the platform. Doing it the wrong way
@@ -51,6 +65,17 @@ public:
     renderer_.reset(
         SDL_CreateRenderer(window_.get(), /* index = */ -1, /* flags= */ 0));
 #endif
+    record("create renderer");
+
+    // The font is uploaded once and every string is then drawn from it.
+    font_texture_.reset(SDL_CreateTexture(
+        renderer_.get(), SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC,
+        bitmap_font::kAtlasWidth, bitmap_font::kAtlasHeight));
+    SDL_UpdateTexture(font_texture_.get(), /* rect = */ nullptr,
+                      bitmap_font::kAtlas.data(),
+                      /* pitch = */ bitmap_font::kAtlasWidth * 4);
+    SDL_SetTextureBlendMode(font_texture_.get(), SDL_BLENDMODE_BLEND);
+    record("upload font");
   }
 
   int width() { return width_; }
@@ -69,22 +94,19 @@ public:
   // Returns false if you should stop polling for events.
   bool PollEvent() {
     SDL_Event sdl_event;
-    bool got_event = SDL_PollEvent(&sdl_event);
-    if (!got_event) {
-      return true;
-    }
-
-    switch (sdl_event.type) {
-    case SDL_QUIT: {
-      return false;
-    }
-    case SDL_KEYDOWN: {
-      for (const auto& handler :
-           key_down_handlers_[sdl_event.key.keysym.scancode]) {
-        handler();
+    while (SDL_PollEvent(&sdl_event)) {
+      switch (sdl_event.type) {
+      case SDL_QUIT: {
+        return false;
+      }
+      case SDL_KEYDOWN: {
+        for (const auto& handler :
+             key_down_handlers_[sdl_event.key.keysym.scancode]) {
+          handler();
+        }
+        break;
+      }
       }
-      break;
-    }
     }
     return true;
   }
@@ -101,20 +123,44 @@ public:
   // Draws the provided text to the screen at the given x,y coordinates and
   // returns the rect which encapsulates the text. The returned rect can be used
   // to make sure other text or objects don't collide with the text.
+  //
+  // Each character is a quad textured from the font atlas, and the whole
+  // string is drawn with one call.
   SDL_Rect DrawText(const std::string& text, int x, int y, const Color& c) {
-    SDL_Color color = {c.r, c.g, c.b};
-    auto message_surface =
-        SdlSurfacePtr(TTF_RenderText_Solid(font_, text.c_str(), color));
-    auto message_texture = SdlTexturePtr(
-        SDL_CreateTextureFromSurface(renderer_.get(), message_surface.get()));
-
-    SDL_Rect rect;
-    rect.x = x;
-    rect.y = y;
-    TTF_SizeText(font_, text.c_str(), &rect.w, &rect.h);
-    SDL_RenderCopy(renderer_.get(), message_texture.get(),
-                   /* crop_rect= */ nullptr, &rect);
-    return rect;
+    constexpr int kGlyphWidth = bitmap_font::kGlyphWidth * kTextScale;
+    constexpr int kGlyphHeight = bitmap_font::kGlyphHeight * kTextScale;
+    constexpr float kAtlasWidth = bitmap_font::kAtlasWidth;
+    constexpr float kAtlasHeight = bitmap_font::kAtlasHeight;
+    SDL_Color color = {c.r, c.g, c.b, 255};
+    text_vertices_.clear();
+    text_indices_.clear();
+    for (size_t i = 0; i < text.size(); ++i) {
+      int glyph_x, glyph_y;
+      bitmap_font::GlyphPosition(text[i], glyph_x, glyph_y);
+      float left = x + int(i) * kGlyphWidth;
+      float top = y;
+      float u = glyph_x / kAtlasWidth;
+      float v = glyph_y / kAtlasHeight;
+      float du = bitmap_font::kGlyphWidth / kAtlasWidth;
+      float dv = bitmap_font::kGlyphHeight / kAtlasHeight;
+      int first = text_vertices_.size();
+      text_vertices_.push_back({{left, top}, color, {u, v}});
+      text_vertices_.push_back({{left + kGlyphWidth, top}, color, {u + du, v}});
+      text_vertices_.push_back(
+          {{left, top + kGlyphHeight}, color, {u, v + dv}});
+      text_vertices_.push_back(
+          {{left + kGlyphWidth, top + kGlyphHeight}, color, {u + du, v + dv}});
+      for (int corner : {0, 1, 2, 1, 3, 2}) {
+        text_indices_.push_back(first + corner);
+      }
+    }
+    SDL_RenderGeometry(renderer_.get(), font_texture_.get(),
+                       text_vertices_.data(), text_vertices_.size(),
+                       text_indices_.data(), text_indices_.size());
+    return SDL_Rect{.x = x,
+                    .y = y,
+                    .w = int(text.size()) * kGlyphWidth,
+                    .h = kGlyphHeight};
   }
 
   // Clear the screen with the provided color.
@@ -128,10 +174,10 @@ public:
       return;
     }
 
+    font_texture_.reset();
     window_surface_.reset();
     window_.reset();
     renderer_.reset();
-    TTF_Quit();
     SDL_Quit();
     open_ = false;
   }
@@ -139,15 +185,21 @@ public:
   ~Screen() { Close(); }
 
 private:
+  // Text is drawn at 3x the font's 8x8 pixels.
+  static constexpr int kTextScale = 3;
+
   SdlWindowPtr window_;
   SdlSurfacePtr window_surface_;
   SdlRendererPtr renderer_;
+  SdlTexturePtr font_texture_;
+  // Reused between calls to `DrawText`.
+  std::vector<SDL_Vertex> text_vertices_;
+  std::vector<int> text_indices_;
   bool open_ = true;
   int width_;
   int height_;
   std::unordered_map<SDL_Scancode, std::vector<std::function<void()>>>
       key_down_handlers_;
-  TTF_Font* font_;
 };
 
 #endif /* SCREEN_H */
@@ -0,0 +1,430 @@
+#ifndef SESSION_SERVER_H
+#define SESSION_SERVER_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chip8-core.h"
+#include "coroutine-scheduler.h"
+#include "profile-cache.h"
+
+// The ROMs a `SessionServer` can start sessions of, by `HashRom`. Each ROM is
+// held once however many sessions are running it.
+class RomStore {
+public:
+  using Rom = std::shared_ptr<const std::vector<unsigned char>>;
+
+  // Adds `rom`, unless it's already here, and returns its hash.
+  uint64_t Add(std::vector<unsigned char> rom) {
+    rom.resize(std::min(rom.size(),
+                        sizeof(Chip8State::memory) - kProgramAddress));
+    auto hash = HashRom(rom);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& stored = roms_[hash];
+    if (!stored) {
+      stored = std::make_shared<const std::vector<unsigned char>>(
+          std::move(rom));
+    }
+    return hash;
+  }
+
+  // The ROM with `hash`, or null if it hasn't been added.
+  Rom Find(uint64_t hash) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = roms_.find(hash);
+    return it == roms_.end() ? nullptr : it->second;
+  }
+
+private:
+  static constexpr int kProgramAddress = 0x200;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, Rom> roms_;
+};
+
+// A daemon which hosts emulator sessions for clients connected to a Unix
+// socket. Sessions run on a `CoroutineScheduler`, so any number of them share
+// a small pool of worker threads.
+//
+// Clients send commands, one per line, and get replies and display updates
+// back as lines:
+//
+//   rom <hex bytes>             adds a ROM          -> rom <hash>
+//   new <hash> [fast] [seed <n>] starts a session   -> session <id>
+//   keys <id> <hex mask>        sets the keys held
+//   stats <id>                  -> stats <id> frames <n> cpu_us <n>
+//   close <id>                  ends a session      -> closed <id>
+//
+// Sessions run in real time (60 frames per second) unless started with
+// `fast`. Failed commands are answered with "error <reason>".
+//
+// Whenever a session's display changes its client is sent
+//
+//   frame <id> <frame> <row>:<16 hex digits> ...
+//
+// with just the rows that differ from the last display it was sent. A client
+// which reads slower than its sessions draw is sent the latest display once
+// it catches up, rather than every frame in between, so a slow client never
+// holds up a worker. A client's sessions end when it disconnects.
+class SessionServer {
+public:
+  SessionServer(const std::string& socket_path, int num_workers)
+      : socket_path_(socket_path), scheduler_(num_workers) {
+    int wake[2];
+    if (::pipe(wake) < 0) {
+      return;
+    }
+    wake_read_ = wake[0];
+    wake_write_ = wake[1];
+    ::fcntl(wake_read_, F_SETFL, O_NONBLOCK);
+    ::fcntl(wake_write_, F_SETFL, O_NONBLOCK);
+
+    sockaddr_un address{.sun_family = AF_UNIX};
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      return;
+    }
+    socket_path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socket_path.c_str());
+    if (listen_fd_ < 0 ||
+        ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+               sizeof(address)) < 0 ||
+        ::listen(listen_fd_, SOMAXCONN) < 0) {
+      if (listen_fd_ >= 0) {
+        ::close(listen_fd_);
+      }
+      listen_fd_ = -1;
+      return;
+    }
+    ::fcntl(listen_fd_, F_SETFL, O_NONBLOCK);
+  }
+
+  ~SessionServer() {
+    for (auto& [fd, client] : clients_) {
+      Disconnect(*client);
+    }
+    if (listen_fd_ >= 0) {
+      ::close(listen_fd_);
+      ::unlink(socket_path_.c_str());
+    }
+    for (int fd : {wake_read_, wake_write_}) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  // False if the socket couldn't be opened.
+  bool ok() const { return listen_fd_ >= 0; }
+
+  RomStore& roms() { return roms_; }
+
+  // Serves clients. Only returns if polling fails.
+  void Serve() {
+    std::vector<pollfd> fds;
+    int timeout = -1;
+    while (true) {
+      fds.clear();
+      fds.push_back({.fd = wake_read_, .events = POLLIN});
+      fds.push_back({.fd = listen_fd_, .events = POLLIN});
+      for (auto& [fd, client] : clients_) {
+        short events = POLLIN;
+        if (!client->output.empty()) {
+          events |= POLLOUT;
+        }
+        fds.push_back({.fd = fd, .events = events});
+      }
+      if (::poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+        return;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        char buffer[64];
+        while (::read(wake_read_, buffer, sizeof(buffer)) > 0) {
+        }
+        frames_pending_ = false;
+      }
+      if (fds[1].revents & POLLIN) {
+        for (int fd; (fd = ::accept(listen_fd_, nullptr, nullptr)) >= 0;) {
+          ::fcntl(fd, F_SETFL, O_NONBLOCK);
+          auto client = std::make_unique<Client>();
+          client->fd = fd;
+          clients_[fd] = std::move(client);
+        }
+      }
+      for (size_t i = 2; i < fds.size(); ++i) {
+        auto& client = *clients_[fds[i].fd];
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+          Read(client);
+        }
+      }
+      SendFrames();
+      // Displays held back from a client which has since read enough of its
+      // output are sent without waiting for the next change to wake us.
+      timeout = -1;
+      for (auto it = clients_.begin(); it != clients_.end();) {
+        auto& client = *it->second;
+        if (client.open) {
+          Write(client);
+        }
+        if (!client.open) {
+          Disconnect(client);
+          it = clients_.erase(it);
+          continue;
+        }
+        if (client.frames_held && client.output.size() < kMaxBufferedOutput) {
+          timeout = 0;
+        }
+        ++it;
+      }
+    }
+  }
+
+private:
+  // Output a client hasn't read yet beyond which display updates wait.
+  static constexpr size_t kMaxBufferedOutput = 64 * 1024;
+  // The longest line a client may send: enough for "rom " and the largest
+  // ROM in hex. A client which sends more without a newline is disconnected
+  // rather than buffered without limit.
+  static constexpr size_t kMaxLineLength = 8 * 1024;
+
+  // What a session's client has been sent of its display, and the newest
+  // display, which the session's worker thread updates after every frame.
+  struct View {
+    int id = 0;
+    std::mutex mutex;
+    std::array<uint64_t, Chip8Core::kDisplayHeight> display{};
+    int64_t frame = 0;
+    bool changed = false;
+    // Set once the session has been removed, after which its worker may still
+    // finish a frame but mustn't wake the server for it.
+    bool closed = false;
+    // Only touched by the server thread.
+    std::array<uint64_t, Chip8Core::kDisplayHeight> sent{};
+  };
+
+  struct Client {
+    int fd = -1;
+    bool open = true;
+    std::string input;
+    std::string output;
+    // Whether some of its sessions' displays weren't sent because its output
+    // was full.
+    bool frames_held = false;
+    std::map<int, std::shared_ptr<View>> sessions;
+  };
+
+  void Read(Client& client) {
+    char buffer[4096];
+    while (client.open) {
+      auto length = ::read(client.fd, buffer, sizeof(buffer));
+      if (length <= 0) {
+        // The commands sent before the client hung up are still run.
+        client.open = length < 0 && (errno == EAGAIN || errno == EINTR);
+        break;
+      }
+      client.input.append(buffer, length);
+      for (auto end = client.input.find('\n'); end != std::string::npos;
+           end = client.input.find('\n')) {
+        Run(client, client.input.substr(0, end));
+        client.input.erase(0, end + 1);
+      }
+      if (client.input.size() > kMaxLineLength) {
+        client.open = false;
+      }
+    }
+  }
+
+  void Write(Client& client) {
+    while (!client.output.empty()) {
+      auto length = ::send(client.fd, client.output.data(),
+                           client.output.size(), MSG_NOSIGNAL);
+      if (length < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          client.open = false;
+        }
+        return;
+      }
+      client.output.erase(0, length);
+    }
+  }
+
+  void Disconnect(Client& client) {
+    for (auto& [id, view] : client.sessions) {
+      Close(*view);
+    }
+    client.sessions.clear();
+    ::close(client.fd);
+  }
+
+  // Removes the session shown in `view`, without waiting for its worker.
+  void Close(View& view) {
+    {
+      std::lock_guard<std::mutex> lock(view.mutex);
+      view.closed = true;
+    }
+    scheduler_.RemoveSession(view.id);
+  }
+
+  void Run(Client& client, const std::string& line) {
+    std::istringstream words(line);
+    std::string command;
+    if (!(words >> command)) {
+      return;
+    }
+    std::ostringstream reply;
+    int id = -1;
+    if (command == "rom") {
+      std::string hex;
+      words >> hex;
+      std::vector<unsigned char> rom;
+      auto digit = [](char c) {
+        return std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10;
+      };
+      for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        rom.push_back(digit(hex[i]) << 4 | digit(hex[i + 1]));
+      }
+      if (hex.empty() || hex.size() % 2 != 0 ||
+          hex.find_first_not_of("0123456789abcdefABCDEF") !=
+              std::string::npos) {
+        reply << "error the ROM must be an even number of hex digits";
+      } else {
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016" PRIx64,
+                      roms_.Add(std::move(rom)));
+        reply << "rom " << hash;
+      }
+    } else if (command == "new") {
+      uint64_t hash = 0;
+      words >> std::hex >> hash >> std::dec;
+      auto rom = roms_.Find(hash);
+      bool real_time = true;
+      uint64_t seed = 0;
+      for (std::string setting; words >> setting;) {
+        if (setting == "fast") {
+          real_time = false;
+        } else if (setting == "seed") {
+          words >> seed;
+        }
+      }
+      if (!rom) {
+        reply << "error no ROM with that hash";
+      } else {
+        auto view = std::make_shared<View>();
+        view->id = scheduler_.AddSession(
+            *rom, seed,
+            [this, view](int, const Chip8Core& core) { Publish(*view, core); },
+            real_time);
+        client.sessions[view->id] = view;
+        reply << "session " << view->id;
+      }
+    } else if (command == "keys" && words >> id &&
+               client.sessions.count(id)) {
+      unsigned keys = 0;
+      words >> std::hex >> keys;
+      scheduler_.SetKeys(id, keys);
+      return;
+    } else if (command == "stats" && words >> id &&
+               client.sessions.count(id)) {
+      CoroutineScheduler::SessionStats stats;
+      scheduler_.GetStats(id, stats);
+      reply << "stats " << id << " frames " << stats.frames << " cpu_us "
+            << stats.cpu_time.count() / 1000;
+    } else if (command == "close" && words >> id &&
+               client.sessions.count(id)) {
+      Close(*client.sessions[id]);
+      client.sessions.erase(id);
+      reply << "closed " << id;
+    } else if (id >= 0) {
+      reply << "error no session " << id;
+    } else {
+      reply << "error unknown command " << command;
+    }
+    client.output += reply.str() + "\n";
+  }
+
+  // Called on a worker thread after each of the session's frames. The server
+  // is only woken while the view's lock is held, so once `Close` has taken it
+  // the session can't write to the wake pipe, even if the pipe is closed.
+  void Publish(View& view, const Chip8Core& core) {
+    std::lock_guard<std::mutex> lock(view.mutex);
+    ++view.frame;
+    if (view.closed || core.state().display == view.display) {
+      return;
+    }
+    view.display = core.state().display;
+    view.changed = true;
+    if (!frames_pending_.exchange(true)) {
+      char wake = 0;
+      (void)::write(wake_write_, &wake, 1);
+    }
+  }
+
+  // Sends each client the rows of its sessions' displays that have changed,
+  // as far as its output buffer allows.
+  void SendFrames() {
+    char row[32];
+    for (auto& [fd, client] : clients_) {
+      client->frames_held = false;
+      for (auto& [id, view] : client->sessions) {
+        if (client->output.size() >= kMaxBufferedOutput) {
+          client->frames_held = true;
+          break;
+        }
+        std::array<uint64_t, Chip8Core::kDisplayHeight> display;
+        int64_t frame;
+        {
+          std::lock_guard<std::mutex> lock(view->mutex);
+          if (!view->changed) {
+            continue;
+          }
+          view->changed = false;
+          display = view->display;
+          frame = view->frame;
+        }
+        auto& output = client->output;
+        output += "frame " + std::to_string(id) + " " + std::to_string(frame);
+        for (int y = 0; y < Chip8Core::kDisplayHeight; ++y) {
+          if (display[y] != view->sent[y]) {
+            std::snprintf(row, sizeof(row), " %d:%016" PRIx64, y, display[y]);
+            output += row;
+          }
+        }
+        output += "\n";
+        view->sent = display;
+      }
+    }
+  }
+
+  std::string socket_path_;
+  RomStore roms_;
+  int listen_fd_ = -1;
+  // Written to by workers to wake `Serve` when there are frames to send.
+  int wake_read_ = -1;
+  int wake_write_ = -1;
+  std::atomic<bool> frames_pending_ = false;
+  std::map<int, std::unique_ptr<Client>> clients_;
+  // Declared last so that its workers stop before the rest is destroyed.
+  CoroutineScheduler scheduler_;
+};
+
+#endif /* SESSION_SERVER_H */
@@ -0,0 +1,64 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A fixed size lock-free queue for exactly one producer thread and one consumer
+// thread, e.g. the emulator thread handing audio samples to the audio thread.
+// Neither side ever blocks or allocates.
+template <typename T> class SpscRing {
+public:
+  // `capacity` is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    items_.resize(size);
+    mask_ = size - 1;
+  }
+
+  // Producer: adds as many of `items` as fit and returns how many that was.
+  size_t Push(const T* items, size_t count) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    count = std::min(count, items_.size() - (tail - head));
+    for (size_t i = 0; i < count; ++i) {
+      items_[(tail + i) & mask_] = items[i];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer: removes up to `count` items into `items` and returns how many
+  // there were.
+  size_t Pop(T* items, size_t count) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_acquire);
+    count = std::min(count, tail - head);
+    for (size_t i = 0; i < count; ++i) {
+      items[i] = items_[(head + i) & mask_];
+    }
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Items waiting to be popped. Only exact when called from one of the two
+  // threads using the ring and the other is idle.
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::vector<T> items_;
+  size_t mask_;
+  // Monotonic positions; only their difference and low bits matter. Kept on
+  // separate cache lines so the two threads don't contend.
+  alignas(64) std::atomic<size_t> head_ = 0;
+  alignas(64) std::atomic<size_t> tail_ = 0;
+};
+
+#endif /* SPSC_RING_H */
@@ -0,0 +1,64 @@
+#ifndef STARTUP_TIMER_H
+#define STARTUP_TIMER_H
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Measures how long each phase of starting up takes, from construction until
+// the first frame is on screen. Phases may run on different threads.
+class StartupTimer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // How long it should take to get the first frame on screen.
+  static constexpr std::chrono::milliseconds kBudget{50};
+
+  StartupTimer() : start_(Clock::now()) {}
+
+  // Records a phase which started at `begin` and has just finished.
+  void Record(const std::string& phase, Clock::time_point begin) {
+    auto end = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    phases_.push_back({phase, begin - start_, end - begin});
+  }
+
+  // The time since construction.
+  Clock::duration elapsed() const { return Clock::now() - start_; }
+
+  // Prints when each phase started and how long it took, and the total time
+  // against `kBudget`.
+  void Report(std::ostream& out, Clock::duration total) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "Startup:\n" << std::fixed << std::setprecision(1);
+    for (auto& phase : phases_) {
+      out << "  " << std::setw(16) << std::left << phase.name << std::right
+          << " at " << std::setw(6) << Milliseconds(phase.start)
+          << "ms, took " << std::setw(6) << Milliseconds(phase.duration)
+          << "ms\n";
+    }
+    out << "  first frame after " << Milliseconds(total) << "ms ("
+        << (total <= kBudget ? "within" : "over") << " the "
+        << kBudget.count() << "ms budget)" << std::endl;
+  }
+
+private:
+  struct Phase {
+    std::string name;
+    Clock::duration start;
+    Clock::duration duration;
+  };
+
+  static double Milliseconds(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+  Clock::time_point start_;
+  mutable std::mutex mutex_;
+  std::vector<Phase> phases_;
+};
+
+#endif /* STARTUP_TIMER_H */
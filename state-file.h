@@ -0,0 +1,152 @@
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "chip8-core.h"
+
+// Writes `state` to `out` in a compact little endian binary format which
+// `ReadState` reads back.
+inline void WriteState(std::ostream& out, const Chip8State& state) {
+  auto write = [&](uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+      out.put((value >> (8 * i)) & 0xFF);
+    }
+  };
+  out.write("chip8-state 2\n", 14);
+  out.write(reinterpret_cast<const char*>(state.memory.data()),
+            state.memory.size());
+  for (auto row : state.display) {
+    write(row, 8);
+  }
+  write(state.stack_depth, 1);
+  for (auto address : state.stack) {
+    write(address, 2);
+  }
+  write(state.program_counter, 2);
+  write(state.index_register, 2);
+  out.write(reinterpret_cast<const char*>(state.variable_registers.data()),
+            state.variable_registers.size());
+  write(state.delay_timer, 1);
+  write(state.sound_timer, 1);
+  write(state.audio_pitch, 1);
+  out.write(reinterpret_cast<const char*>(state.audio_pattern.data()),
+            state.audio_pattern.size());
+  write(state.random_seed, 8);
+  write(state.random_counter, 8);
+  write(uint8_t(state.fault), 1);
+}
+
+// Reads a state written by `WriteState`. Returns false if `in` doesn't hold
+// one, in which case `state` may have been partly overwritten.
+//
+// States from before the stack had a fixed size (version 1, which stored just
+// the return addresses in use) are read too, so that old save states and
+// replays still load.
+inline bool ReadState(std::istream& in, Chip8State& state) {
+  auto read = [&](int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; ++i) {
+      value |= uint64_t(uint8_t(in.get())) << (8 * i);
+    }
+    return value;
+  };
+  char magic[14];
+  if (!in.read(magic, sizeof(magic))) {
+    return false;
+  }
+  std::string version(magic, sizeof(magic));
+  if (version != "chip8-state 1\n" && version != "chip8-state 2\n") {
+    return false;
+  }
+  in.read(reinterpret_cast<char*>(state.memory.data()), state.memory.size());
+  for (auto& row : state.display) {
+    row = read(8);
+  }
+  state.stack.fill(0);
+  if (version == "chip8-state 1\n") {
+    auto depth = read(2);
+    if (depth > state.stack.size()) {
+      return false;
+    }
+    state.stack_depth = depth;
+    for (size_t i = 0; i < depth; ++i) {
+      state.stack[i] = read(2);
+    }
+  } else {
+    state.stack_depth = std::min<uint64_t>(read(1), state.stack.size());
+    for (auto& address : state.stack) {
+      address = read(2);
+    }
+  }
+  state.program_counter = read(2) % 4096;
+  state.index_register = read(2);
+  in.read(reinterpret_cast<char*>(state.variable_registers.data()),
+          state.variable_registers.size());
+  state.delay_timer = read(1);
+  state.sound_timer = read(1);
+  state.audio_pitch = read(1);
+  in.read(reinterpret_cast<char*>(state.audio_pattern.data()),
+          state.audio_pattern.size());
+  state.random_seed = read(8);
+  state.random_counter = read(8);
+  auto fault = read(1);
+  state.fault = fault <= uint8_t(Chip8Fault::kStackUnderflow)
+                    ? Chip8Fault(fault)
+                    : Chip8Fault::kNone;
+  return bool(in);
+}
+
+// A 64 bit hash of everything in `state`, in the same order as `WriteState`
+// and independent of the machine's byte order, so it's the same from one
+// build (or machine) to the next. Two machines with equal hashes are almost
+// certainly in the same state.
+//
+// Memory is hashed 8 bytes at a time to keep this cheap enough to run every
+// frame. Each step folds the high half of the hash into the low half, so the
+// low 32 bits alone still depend on every bit of the state. The one exception
+// is the stack entries past its depth, which only a game whose stack wraps
+// around can read back; leaving them out keeps the hash the same as it was
+// before the stack had a fixed size, so replays recorded then still verify.
+inline uint64_t HashState(const Chip8State& state) {
+  uint64_t hash = 0xcbf29ce484222325;
+  auto add = [&](uint64_t value) {
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+    hash ^= hash >> 32;
+  };
+  for (size_t i = 0; i < state.memory.size(); i += 8) {
+    uint64_t word = 0;
+    for (int byte = 0; byte < 8; ++byte) {
+      word |= uint64_t(state.memory[i + byte]) << (8 * byte);
+    }
+    add(word);
+  }
+  for (auto row : state.display) {
+    add(row);
+  }
+  add(state.stack_depth);
+  for (int i = 0; i < state.stack_depth; ++i) {
+    add(state.stack[i]);
+  }
+  add(state.program_counter);
+  add(state.index_register);
+  for (auto value : state.variable_registers) {
+    add(value);
+  }
+  add(state.delay_timer);
+  add(state.sound_timer);
+  add(state.audio_pitch);
+  for (auto byte : state.audio_pattern) {
+    add(byte);
+  }
+  add(state.random_seed);
+  add(state.random_counter);
+  add(uint8_t(state.fault));
+  return hash;
+}
+
+#endif /* STATE_FILE_H */
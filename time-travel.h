@@ -0,0 +1,179 @@
+#ifndef TIME_TRAVEL_H
+#define TIME_TRAVEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include "chip8-core.h"
+
+// Records a game as a keyframe snapshot every `kKeyframeInterval` frames plus
+// the keys that were held in every frame, which is enough to put the machine
+// back to how it was after any instruction: restore the keyframe before it
+// and re-run from there. At most a second of emulation is ever re-run, which
+// takes microseconds, so going backwards is instant however long the game
+// has been running.
+//
+// Points in the recording are positions: the number of instructions run since
+// it began. Each frame is `Chip8Core::kInstructionsPerFrame` instructions with
+// the frame's keys set before the first and the timers ticked after the last,
+// exactly as `Chip8Core::RunFrame` runs them.
+class TimeTravel {
+public:
+  static constexpr int kKeyframeInterval = 60;
+
+  explicit TimeTravel(Chip8Core& core) : core_(core) { Restart(); }
+
+  // Starts a new recording from the machine as it is now, e.g. after its
+  // state was replaced wholesale.
+  void Restart() {
+    keyframes_.resize(1);
+    core_.SaveState(keyframes_[0]);
+    keys_.clear();
+    position_ = 0;
+  }
+
+  int64_t position() const { return position_; }
+  // The position of the latest instruction that was recorded.
+  int64_t end() const {
+    return int64_t(keys_.size()) * Chip8Core::kInstructionsPerFrame;
+  }
+
+  // Throws away the recording after the current frame, so that `Step` goes
+  // on to record new frames rather than replaying old ones, e.g. when the
+  // game is played from a point it was rewound to.
+  void Truncate() {
+    keys_.resize((position_ + Chip8Core::kInstructionsPerFrame - 1) /
+                 Chip8Core::kInstructionsPerFrame);
+    keyframes_.resize(std::max<size_t>(
+        1, (keys_.size() + kKeyframeInterval - 1) / kKeyframeInterval));
+  }
+
+  // Records a frame that is about to be run, at full speed, with `keys`, and
+  // moves past it. Must be called on a frame boundary.
+  void RecordFrame(uint16_t keys) {
+    Truncate();
+    AppendFrame(keys);
+    position_ += Chip8Core::kInstructionsPerFrame;
+  }
+
+  // Runs one instruction. Frames which were recorded are replayed with their
+  // keys; beyond the end of the recording a new frame is recorded with `keys`.
+  void Step(uint16_t keys) {
+    auto instruction = position_ % Chip8Core::kInstructionsPerFrame;
+    if (instruction == 0) {
+      auto frame = position_ / Chip8Core::kInstructionsPerFrame;
+      if (position_ == end()) {
+        AppendFrame(keys);
+      }
+      core_.SetKeys(keys_[frame]);
+    }
+    core_.Step();
+    ++position_;
+    if (instruction == Chip8Core::kInstructionsPerFrame - 1) {
+      core_.TickTimers();
+    }
+  }
+
+  // Puts the machine back to how it was at `position`, which must be within
+  // the recording.
+  void Seek(int64_t position) {
+    auto frame = position / Chip8Core::kInstructionsPerFrame;
+    auto keyframe = std::min<int64_t>(frame / kKeyframeInterval,
+                                      keyframes_.size() - 1);
+    core_.LoadState(keyframes_[keyframe]);
+    position_ =
+        keyframe * kKeyframeInterval * Chip8Core::kInstructionsPerFrame;
+    while (position_ < position) {
+      Step(/* keys = */ 0);
+    }
+  }
+
+  // Goes back `count` instructions, or to the start of the recording. Returns
+  // false if already there.
+  bool StepBack(int64_t count = 1) {
+    if (position_ == 0) {
+      return false;
+    }
+    Seek(std::max<int64_t>(0, position_ - count));
+    return true;
+  }
+
+  // Goes back to the last time the program counter was at one of
+  // `breakpoints`, stopping before that instruction runs. Returns false,
+  // without moving, if it never was.
+  bool ReverseContinue(const std::set<uint16_t>& breakpoints) {
+    return RunBackTo([&](const Chip8State& state) {
+      return breakpoints.count(state.program_counter) > 0;
+    });
+  }
+
+  // Goes back to just before the last instruction that stored to memory at
+  // `address` (with FX33 or FX55). Returns false, without moving, if none
+  // did.
+  bool RunBackToWrite(uint16_t address) {
+    return RunBackTo([&](const Chip8State& state) {
+      auto pc = state.program_counter;
+      uint16_t instruction =
+          (state.memory[pc] << 8) | state.memory[(pc + 1) % 4096];
+      int length = 0;
+      if ((instruction & 0xF0FF) == 0xF033) {
+        length = 3;
+      } else if ((instruction & 0xF0FF) == 0xF055) {
+        length = ((instruction >> 8) & 0xF) + 1;
+      }
+      // Stores wrap around the end of memory.
+      return ((address - state.index_register) & Chip8Core::kAddressMask) <
+             length;
+    });
+  }
+
+private:
+  // Adds a frame to the end of the recording, which the machine is at.
+  void AppendFrame(uint16_t keys) {
+    auto frame = keys_.size();
+    if (frame % kKeyframeInterval == 0) {
+      keyframes_.resize(frame / kKeyframeInterval + 1);
+      core_.SaveState(keyframes_.back());
+    }
+    keys_.push_back(keys);
+  }
+
+  // Goes back to the latest position before the current one where `matches`
+  // is true of the state. Each keyframe interval is searched forwards in turn,
+  // starting with the latest.
+  template <typename Predicate> bool RunBackTo(Predicate matches) {
+    auto original = position_;
+    auto target = position_;
+    auto interval = int64_t(kKeyframeInterval) *
+                    Chip8Core::kInstructionsPerFrame;
+    for (auto start = (target - 1) / interval * interval; start >= 0;
+         start -= interval) {
+      Seek(start);
+      int64_t found = -1;
+      for (; position_ < target; Step(/* keys = */ 0)) {
+        if (matches(core_.state())) {
+          found = position_;
+        }
+      }
+      if (found >= 0) {
+        Seek(found);
+        return true;
+      }
+      target = start;
+    }
+    Seek(original);
+    return false;
+  }
+
+  Chip8Core& core_;
+  // `keyframes_[i]` is the state at the start of frame
+  // `i * kKeyframeInterval`.
+  std::vector<Chip8State> keyframes_;
+  // The keys held in each frame of the recording.
+  std::vector<uint16_t> keys_;
+  int64_t position_ = 0;
+};
+
+#endif /* TIME_TRAVEL_H */
@@ -0,0 +1,155 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "chip8-core.h"
+
+// Limits on how long an unattended run of a ROM may go on for. A limit of 0
+// means no limit.
+struct WatchdogLimits {
+  int64_t max_frames = 0;
+  int64_t max_instructions = 0;
+  std::chrono::nanoseconds max_wall_time{0};
+  // Stop runs which are provably stuck in an infinite loop.
+  bool detect_hangs = true;
+};
+
+// Why a run was stopped.
+enum class WatchdogResult {
+  kRunning,
+  kFrameLimit,
+  kInstructionLimit,
+  kWallTimeLimit,
+  // The machine came back to a state it had already been in with the same
+  // keys held, so it would repeat the same frames forever.
+  kHung,
+  // The machine stopped on an instruction it couldn't run; see `Chip8Fault`.
+  kFaulted,
+};
+
+inline std::string ToString(WatchdogResult result) {
+  switch (result) {
+  case WatchdogResult::kRunning:
+    return "running";
+  case WatchdogResult::kFrameLimit:
+    return "frame limit";
+  case WatchdogResult::kInstructionLimit:
+    return "instruction limit";
+  case WatchdogResult::kWallTimeLimit:
+    return "time limit";
+  case WatchdogResult::kHung:
+    return "hung";
+  case WatchdogResult::kFaulted:
+    return "faulted";
+  }
+  return "";
+}
+
+// Decides when a headless run of a core should stop: when it hits one of its
+// limits, when the machine faults, or when it hangs.
+//
+// A core is a pure function of its state and the keys held down, so if the
+// state at the end of a frame is one that was already seen since the keys last
+// changed the machine is in a cycle it will never leave. Cycles are found with
+// Brent's algorithm: a reference state is kept and compared against the state
+// after every frame, and is replaced at frame 1, 2, 4, 8, ... which finds a
+// cycle of `p` frames within a few multiples of `p` frames of entering it.
+// Comparing against the reference checks the registers first, so the full
+// comparison of memory and display only runs when the program counter and
+// registers already match.
+class Watchdog {
+public:
+  explicit Watchdog(const WatchdogLimits& limits = {}) : limits_(limits) {}
+
+  // Starts watching a new run, which is at `core`'s current state.
+  void Start(const Chip8Core& core) {
+    frames_ = 0;
+    hang_period_ = 0;
+    start_ = std::chrono::steady_clock::now();
+    ResetHangCheck(core);
+  }
+
+  // Call after each frame of the run with the keys that were held during it.
+  // Returns `kRunning` while the run should carry on.
+  WatchdogResult Check(const Chip8Core& core, uint16_t keys) {
+    ++frames_;
+    if (core.state().fault != Chip8Fault::kNone) {
+      return WatchdogResult::kFaulted;
+    }
+    if (limits_.detect_hangs && CheckHang(core, keys)) {
+      return WatchdogResult::kHung;
+    }
+    if (limits_.max_frames > 0 && frames_ >= limits_.max_frames) {
+      return WatchdogResult::kFrameLimit;
+    }
+    if (limits_.max_instructions > 0 &&
+        frames_ * Chip8Core::kInstructionsPerFrame >=
+            limits_.max_instructions) {
+      return WatchdogResult::kInstructionLimit;
+    }
+    // Reading the clock costs about as much as running a frame, so it's only
+    // checked occasionally.
+    if (limits_.max_wall_time.count() > 0 &&
+        frames_ % kFramesPerClockCheck == 0 &&
+        std::chrono::steady_clock::now() - start_ >= limits_.max_wall_time) {
+      return WatchdogResult::kWallTimeLimit;
+    }
+    return WatchdogResult::kRunning;
+  }
+
+  // The number of frames checked since `Start`.
+  int64_t frames() const { return frames_; }
+
+  // After `kHung`, the number of frames in the cycle that the machine is in.
+  int64_t hang_period() const { return hang_period_; }
+
+private:
+  void ResetHangCheck(const Chip8Core& core) {
+    core.SaveState(reference_);
+    power_ = 1;
+    distance_ = 0;
+  }
+
+  bool CheckHang(const Chip8Core& core, uint16_t keys) {
+    if (keys != keys_) {
+      keys_ = keys;
+      ResetHangCheck(core);
+      return false;
+    }
+    ++distance_;
+    if (SameState(core.state(), reference_)) {
+      hang_period_ = distance_;
+      return true;
+    }
+    if (distance_ == power_) {
+      core.SaveState(reference_);
+      power_ *= 2;
+      distance_ = 0;
+    }
+    return false;
+  }
+
+  static bool SameState(const Chip8State& a, const Chip8State& b) {
+    return a.program_counter == b.program_counter &&
+           a.index_register == b.index_register &&
+           a.variable_registers == b.variable_registers &&
+           a.delay_timer == b.delay_timer && a.sound_timer == b.sound_timer &&
+           a.random_counter == b.random_counter && a == b;
+  }
+
+  static constexpr int kFramesPerClockCheck = 256;
+
+  WatchdogLimits limits_;
+  int64_t frames_ = 0;
+  std::chrono::steady_clock::time_point start_;
+  uint16_t keys_ = 0;
+  Chip8State reference_;
+  int64_t power_ = 1;
+  int64_t distance_ = 0;
+  int64_t hang_period_ = 0;
+};
+
+#endif /* WATCHDOG_H */